@@ -0,0 +1,119 @@
+#include "Image.hpp"
+
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define IMAGE_MMAP_SUPPORTED
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+Image::Image(const std::string filename, const size_t mem_size, const size_t alignment) :
+	filename(filename), size(mem_size)
+{
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	if (alignment == 0)
+		error("Image alignment should be greater than 0");
+
+#if defined(IMAGE_MMAP_SUPPORTED)
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		error("Could not open the image file");
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		error("Could not get the size of the image file");
+	}
+	fsize = st.st_size;
+
+	if (fsize > mem_size || fsize % alignment != 0)
+	{
+		close(fd);
+		error("Corrupt image file");
+	}
+
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	mapped_size = (mem_size + page_size - 1) / page_size * page_size;
+
+	// Zero-filled memory for the whole image, then the file is mapped over its beginning
+	void *region = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED)
+	{
+		close(fd);
+		error("Failed to allocate memory for the image");
+	}
+	mem = static_cast<uint8_t*>(region);
+
+	if (fsize > 0)
+	{
+		// The tail of the last file page past the end of the file reads as zeros
+		const size_t file_pages = (fsize + page_size - 1) / page_size * page_size;
+		if (mmap(mem, file_pages, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+		{
+			close(fd);
+			munmap(mem, mapped_size);
+			error("Failed to map the image file");
+		}
+	}
+
+	close(fd);
+#else
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+		error("Could not open the image file");
+
+	fsize = file.tellg();
+	if (fsize > mem_size || fsize % alignment != 0)
+		error("Corrupt image file");
+
+	buffer.resize(mem_size);
+	mem = buffer.data();
+
+	file.seekg(0);
+	if (!file.read(reinterpret_cast<char*>(mem), fsize))
+		error("Could not read the image file");
+#endif
+
+	load_duration = std::chrono::steady_clock::now() - start;
+}
+
+Image::~Image()
+{
+#if defined(IMAGE_MMAP_SUPPORTED)
+	if (mapped_size != 0)
+		munmap(mem, mapped_size);
+#endif
+}
+
+size_t Image::size_of(const std::string filename)
+{
+#if defined(IMAGE_MMAP_SUPPORTED)
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		throw std::runtime_error("ERROR: Could not open the image file (" + filename + ")");
+
+	return st.st_size;
+#else
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+		throw std::runtime_error("ERROR: Could not open the image file (" + filename + ")");
+
+	return file.tellg();
+#endif
+}
+
+double Image::load_time_ms() const
+{
+	return std::chrono::duration<double, std::milli>(load_duration).count();
+}
+
+void Image::error(const std::string msg) const
+{
+	throw std::runtime_error("ERROR: " + msg + " (" + filename + ")");
+}
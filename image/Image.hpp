@@ -0,0 +1,51 @@
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/*
+ * A program image placed at the start of a zero-filled, writable region of
+ * mem_size bytes. On POSIX hosts the file is mapped copy-on-write, so the
+ * pages are only read in on first access and several images of the same file
+ * share the unmodified ones. Elsewhere the file is read in a single call.
+ */
+class Image
+{
+public:
+	// alignment - the file size must be a multiple of it, e.g. 2 for 16-bit instructions
+	Image(const std::string filename, const size_t mem_size, const size_t alignment = 1);
+	~Image();
+
+	Image(const Image&) = delete;
+	Image &operator=(const Image&) = delete;
+
+	static size_t size_of(const std::string filename); // Size of a file before it is loaded
+
+	uint8_t *data() { return mem; }
+	const uint8_t *data() const { return mem; }
+
+	size_t mem_size() const { return size; }
+	size_t file_size() const { return fsize; }
+	std::chrono::steady_clock::duration load_time() const { return load_duration; }
+	double load_time_ms() const;
+
+private:
+	void error(const std::string msg) const;
+
+	const std::string filename;
+
+	uint8_t *mem = nullptr;
+	size_t size;
+	size_t fsize = 0;
+
+	size_t mapped_size = 0; // 0 - the image lives in buffer
+	std::vector<uint8_t> buffer;
+
+	std::chrono::steady_clock::duration load_duration;
+};
+
+#endif
@@ -1,173 +1,385 @@
 #include "Assembler.hpp"
 
+#include <climits>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 
-Assembler::Assembler(std::string source_path, std::string dest_path) :
-	dest_path(dest_path)
+namespace
 {
-	input.open(source_path);
-	if (!input.is_open())
-		error("Failed to open source code");
+	Image *load_source(const std::string source_path)
+	{
+		try
+		{
+			return new Image(source_path, Image::size_of(source_path) + 1);
+		}
+		catch (const std::runtime_error&)
+		{
+			throw std::runtime_error("Failed to open source code");
+		}
+	}
 }
 
-Assembler::~Assembler()
+Assembler::Assembler(std::string source_path) :
+	source(load_source(source_path)),
+	lexer(reinterpret_cast<const char*>(source->data()))
+{}
+
+uint64_t Assembler::get_source_hash() const
 {
-	if (input.is_open())
-		input.close();
+	return Object::hash(source->data(), source->file_size());
 }
 
-void Assembler::assemble()
+Object Assembler::assemble()
 {
-	while (!input.eof())
+	Lexer::Token next;
+	while (next_token(next))
 	{
-		std::string next;
-		input >> next;
+		if (next.kind == Lexer::Token::Instruction && next.mnemonic == Lexer::CALL)
+		{
+			program.push_back(Lexer::PUSH);
+
+			const int32_t after_jmp_addr = program.size() + 3 * sizeof(uint8_t) + 2 * sizeof(int32_t);
+			return_addresses.push_back(program.size());
+			push_int32(after_jmp_addr);
 
-		if (is_present_in_map(&instrs, next)) // Is next an instruction?
+			program.push_back(Lexer::PUSHIP);
+
+			program.push_back(Lexer::PUSH);
+			handle_operand(next);
+			program.push_back(Lexer::JMP);
+		}
+		else if (next.kind == Lexer::Token::Instruction)
 		{
-			program.push_back(instrs.at(next));
+			program.push_back(next.mnemonic);
 
-			if (next == "PUSH")
-				handle_operand("PUSH");
+			if (next.mnemonic == Lexer::PUSH)
+				handle_operand(next);
 		}
-		else
+		else if (next.kind == Lexer::Token::LabelDecl)
 		{
-			if (next.empty())
-				error("Got an empty string");
-			else if (next == "CALL")
-			{
-				program.push_back(instrs.at("PUSH"));
+			if (next.length == 0)
+				error("Colon should be preceeded with a label name" + Lexer::position(next));
+			else if (Lexer::find_mnemonic(next.text, next.length) != Lexer::NOT_A_MNEMONIC)
+				error("Label cannot be named one of the reserved words" + Lexer::position(next));
+
+			LabelTable::Label &label = labels.get(next.text, next.length);
+			if (label.address != LabelTable::UNDECLARED)
+				error("Label redeclaration" + Lexer::position(next));
+			label.address = program.size();
+		}
+		else if (next.kind == Lexer::Token::Name)
+		{
+			const std::string name(next.text, next.length);
 
-				int32_t after_jmp_addr = program.size() + 3 * sizeof(uint8_t) + 2 * sizeof(int32_t);
-				swap_endianness(&after_jmp_addr);
-				const uint8_t *after_jmp_addr_uint8_t_repr = reinterpret_cast<const uint8_t*>(&after_jmp_addr);
-				for (size_t i = 0; i < sizeof(int32_t); i++)
-					program.push_back(after_jmp_addr_uint8_t_repr[i]);
+			if (name == ".macro")
+				define_macro(next);
+			else if (name == ".equ")
+				define_constant(next);
+			else if (name == ".byte")
+				define_byte(next);
+			else if (name == ".endm")
+				error(".endm without .macro" + Lexer::position(next));
+			else if (macros.count(name) != 0)
+				expand_macro(macros[name], next);
+			else
+				error("Unknown symbol" + Lexer::position(next));
+		}
+		else
+			error("Unknown symbol" + Lexer::position(next));
+	}
 
-				program.push_back(instrs.at("PUSHIP"));
+	return make_object();
+}
 
-				program.push_back(instrs.at("PUSH"));
-				handle_operand("CALL");
-				program.push_back(instrs.at("JMP"));
-			}
-			else if (next.back() == ':') // Is next a label declaration?
+bool Assembler::next_token(Lexer::Token &token)
+{
+	if (has_pending)
+	{
+		has_pending = false;
+		token = pending;
+		return true;
+	}
+
+	while (!expansions.empty())
+	{
+		Expansion &expansion = expansions.back();
+		if (expansion.next == expansion.macro->body.size())
+		{
+			expansions.pop_back();
+			continue;
+		}
+
+		token = expansion.macro->body[expansion.next++];
+		token.scope = expansions.size();
+
+		// A parameter on its own is replaced with the argument, inside expressions it is resolved later
+		if (token.kind == Lexer::Token::Name || token.kind == Lexer::Token::LabelDecl)
+		{
+			const std::vector<Lexer::Token> &params = expansion.macro->params;
+			for (size_t i = 0; i < params.size(); i++)
 			{
-				next.pop_back();
+				if (params[i].length != token.length || std::memcmp(params[i].text, token.text, token.length) != 0)
+					continue;
+
+				const Lexer::Token::Kind kind = token.kind;
+				const size_t line = token.line, column = token.column;
+				token = expansion.args[i];
+				token.line = line;
+				token.column = column;
 
-				if (next.empty())
-					error("Colon should be preceeded with a label name");
-				else if (next == "CALL" || is_present_in_map(&instrs, next)) // Is next an instruction?
-					error("Label cannot be named one of the reserved words");
-				else if (is_present_in_map(&labels, next)) // Does this label already exist?
+				if (kind == Lexer::Token::LabelDecl)
 				{
-					auto &value_pair = labels.at(next);
-					if (value_pair.second != INITIAL_ADDRESS)
-						error("Label redeclaration");
-					value_pair.second = program.size();
+					if (token.kind != Lexer::Token::Name)
+						error("Invalid label name" + Lexer::position(token));
+					token.kind = Lexer::Token::LabelDecl;
 				}
-				else
-					labels.emplace(next,
-						std::make_pair(std::vector<size_t>(), program.size()));
+				break;
 			}
-			//else if (*comment*) ADD COMMENT FUNCTIONALITY!!!
-			else
-				error("Unknown symbol");
 		}
-	}
 
-	put_labels_in_reserved_spaces();
+		return true;
+	}
 
-	write_program();
+	return lexer.next(token);
 }
 
-template <class Key, class Value>
-bool Assembler::is_present_in_map(const std::map<Key, Value> *m, const Key key)
+void Assembler::unget_token(const Lexer::Token &token)
 {
-	return m -> find(key) != m -> end();
+	pending = token;
+	has_pending = true;
 }
 
-void Assembler::handle_operand(const std::string instr_name)
+void Assembler::define_macro(const Lexer::Token &directive)
 {
-	std::string operand_str;
-	if (input.eof())
-		error(instr_name + " used without an operand");
-	input >> operand_str;
+	// .macro NAME PARAM... on one line, then the body up to .endm
+	if (directive.scope != 0)
+		error("A macro cannot be defined inside a macro" + Lexer::position(directive));
 
-	try
+	Lexer::Token name;
+	if (!next_token(name) || name.line != directive.line)
+		error(".macro used without a name" + Lexer::position(directive));
+	if (name.kind == Lexer::Token::Instruction)
+		error("Macro cannot be named one of the reserved words" + Lexer::position(name));
+	if (name.kind != Lexer::Token::Name || Expression::is_operator(name.text[0]))
+		error("Invalid macro name" + Lexer::position(name));
+
+	Macro macro;
+	Lexer::Token token;
+	while (next_token(token))
 	{
-		int32_t integer = std::stoi(operand_str); // Is operand_str an integer?
-		swap_endianness(&integer);
-		uint8_t *integer_uint8_t_repr = reinterpret_cast<uint8_t*>(&integer);
-		for (size_t i = 0; i < sizeof(int32_t); i++)
-			program.push_back(integer_uint8_t_repr[i]);
+		if (token.line != directive.line)
+		{
+			unget_token(token);
+			break;
+		}
+		if (token.kind != Lexer::Token::Name)
+			error("Invalid macro parameter" + Lexer::position(token));
+		macro.params.push_back(token);
 	}
-	catch (const std::invalid_argument&)
-	{
-		if (is_present_in_map(&instrs, operand_str)) // Is operand_str an instruction?
-			error("An instruction cannot be an operand to " + instr_name);
-		else if (is_present_in_map(&labels, operand_str)) // Does this label already exist?
-			labels.at(operand_str).first.push_back(program.size());
-		else
-			labels.emplace(operand_str,
-				std::make_pair(std::vector<size_t>(1, program.size()),
-				INITIAL_ADDRESS));
 
-		reserve_space_for_label();
-	}
-	catch (const std::out_of_range&)
+	for (;;)
 	{
-		error("Integer is too big");
+		if (!next_token(token))
+			error(".macro without .endm" + Lexer::position(directive));
+
+		if (token.kind == Lexer::Token::Name)
+		{
+			const std::string text(token.text, token.length);
+			if (text == ".endm")
+				break;
+			if (text == ".macro")
+				error("A macro cannot be defined inside a macro" + Lexer::position(token));
+		}
+		macro.body.push_back(token);
 	}
+
+	if (!macros.emplace(std::string(name.text, name.length), macro).second)
+		error("Macro redeclaration" + Lexer::position(name));
 }
 
-void Assembler::reserve_space_for_label()
+void Assembler::define_constant(const Lexer::Token &directive)
 {
-	for (size_t i = 0; i < sizeof(int32_t); i += sizeof(uint8_t))
-		program.push_back(0);
+	// .equ NAME EXPRESSION
+	Lexer::Token name, value;
+	if (!next_token(name) || !next_token(value))
+		error(".equ needs a name and a value" + Lexer::position(directive));
+	if (name.kind == Lexer::Token::Instruction)
+		error("Constant cannot be named one of the reserved words" + Lexer::position(name));
+	if (name.kind != Lexer::Token::Name)
+		error("Invalid constant name" + Lexer::position(name));
+
+	const ExpressionValue result = evaluate(value);
+	if (result.label != nullptr)
+		error("A constant cannot refer to a label" + Lexer::position(value));
+
+	if (!constants.emplace(std::string(name.text, name.length), result.value).second)
+		error("Constant redeclaration" + Lexer::position(name));
+}
+
+void Assembler::define_byte(const Lexer::Token &directive)
+{
+	// .byte EXPRESSION, placed into the code as is
+	Lexer::Token value;
+	if (!next_token(value))
+		error(".byte needs a value" + Lexer::position(directive));
+
+	const ExpressionValue result = evaluate(value);
+	if (result.label != nullptr)
+		error("A byte cannot refer to a label" + Lexer::position(value));
+	if (result.value < INT8_MIN || result.value > UINT8_MAX)
+		error("Byte is out of range" + Lexer::position(value));
+
+	program.push_back(static_cast<uint8_t>(result.value));
 }
 
-void Assembler::put_labels_in_reserved_spaces()
+void Assembler::expand_macro(const Macro &macro, const Lexer::Token &invocation)
 {
-	for (auto &elem : labels)
+	if (expansions.size() == MAX_EXPANSION_DEPTH)
+		error("Macros are nested too deep" + Lexer::position(invocation));
+
+	Expansion expansion = { &macro, std::vector<Lexer::Token>(macro.params.size()), 0 };
+	for (Lexer::Token &arg : expansion.args)
+		if (!next_token(arg))
+			error(std::string(invocation.text, invocation.length) + " expects " +
+				std::to_string(macro.params.size()) + " arguments" + Lexer::position(invocation));
+
+	expansions.push_back(expansion);
+}
+
+ExpressionValue Assembler::evaluate(const Lexer::Token &token)
+{
+	ExpressionValue result;
+
+	if (token.kind == Lexer::Token::Integer)
+		result.value = token.value;
+	else if (token.kind != Lexer::Token::Name)
+		error("Invalid expression" + Lexer::position(token));
+	else
 	{
-		if (elem.second.second == INITIAL_ADDRESS) // if label declaration's address == INITIAL_ADDRESS
-			error("Label used without a declaration");
+		try
+		{
+			const size_t scope = token.scope;
+			result = Expression::evaluate(token.text, token.length,
+				[this, scope](const char *name, const size_t length, ExpressionValue &value)
+				{
+					return resolve(name, length, scope, value);
+				});
+		}
+		catch (const std::runtime_error &ex)
+		{
+			error(ex.what() + Lexer::position(token));
+		}
+	}
 
-		swap_endianness(&elem.second.second);
+	return result;
+}
 
-		for (auto &usage : elem.second.first)
+bool Assembler::resolve(const char *name, const size_t length, const size_t scope, ExpressionValue &value)
+{
+	// Parameters of the expansion the expression came from, then constants, anything else is a label
+	if (scope != 0)
+	{
+		const Expansion &expansion = expansions[scope - 1];
+		for (size_t i = 0; i < expansion.macro->params.size(); i++)
 		{
-			const uint8_t *value_uint8_t_repr = reinterpret_cast<const uint8_t*>(&elem.second.second);
-			for (size_t i = 0; i < sizeof(int32_t); i++)
-				program[usage + i] = value_uint8_t_repr[i];
+			const Lexer::Token &param = expansion.macro->params[i];
+			if (param.length != length || std::memcmp(param.text, name, length) != 0)
+				continue;
+
+			const Lexer::Token &arg = expansion.args[i];
+			if (arg.kind == Lexer::Token::Integer)
+				value.value = arg.value;
+			else if (arg.kind == Lexer::Token::Name)
+			{
+				const size_t arg_scope = arg.scope;
+				value = Expression::evaluate(arg.text, arg.length,
+					[this, arg_scope](const char *name, const size_t length, ExpressionValue &value)
+					{
+						return resolve(name, length, arg_scope, value);
+					});
+			}
+			else
+				throw std::runtime_error("Invalid expression");
+
+			return true;
 		}
 	}
+
+	const auto constant = constants.find(std::string(name, length));
+	if (constant == constants.end())
+		return false;
+
+	value.value = constant->second;
+	return true;
 }
 
-void Assembler::swap_endianness(int32_t* value)
+void Assembler::handle_operand(const Lexer::Token &instr)
 {
-	*value = (*value >> 24) | ((*value >> 8) & 0xFF00) |
-		((*value << 8) & 0xFF0000) | (*value << 24);
+	const std::string instr_name(instr.text, instr.length);
+
+	Lexer::Token operand;
+	if (!next_token(operand))
+		error(instr_name + " used without an operand" + Lexer::position(instr));
+
+	switch (operand.kind)
+	{
+	case Lexer::Token::Integer:
+		push_int32(operand.value);
+		break;
+	case Lexer::Token::Name:
+	{
+		const ExpressionValue value = evaluate(operand);
+		if (value.label != nullptr)
+			labels.get(value.label, value.label_length).usages.push_back(program.size());
+		push_int32(value.value); // The linker adds the label's address
+		break;
+	}
+	case Lexer::Token::Instruction:
+		error("An instruction cannot be an operand to " + instr_name + Lexer::position(operand));
+		break;
+	default:
+		error("Unknown symbol" + Lexer::position(operand));
+	}
 }
 
-void Assembler::error(std::string msg)
+void Assembler::push_int32(const int32_t value)
 {
-	throw std::runtime_error(msg);
+	// Big-endian, as QProc reads it
+	for (int shift = 24; shift >= 0; shift -= CHAR_BIT)
+		program.push_back(static_cast<uint8_t>(static_cast<uint32_t>(value) >> shift));
 }
 
-void Assembler::write_program()
+Object Assembler::make_object()
 {
-	const int MAX_PROG_SIZE = 204800;
-	if (program.size() > MAX_PROG_SIZE)
-		error("Resulting program's size is bigger than MAX_PROG_SIZE");
+	Object object;
+	object.assembler_version = VERSION;
+	object.source_hash = get_source_hash();
+	object.code.swap(program);
+
+	for (const auto &label : labels.all())
+	{
+		const std::string name(label.name, label.length);
 
-	std::ofstream output;
-	output.open(dest_path, std::ios::binary | std::ios::trunc);
-	if (!output.is_open())
-		error("Could not open ROM");
+		if (label.address != LabelTable::UNDECLARED)
+			object.symbols.push_back(Object::Symbol{ name, static_cast<uint32_t>(label.address) });
+
+		if (label.usages.empty())
+			continue;
+
+		for (const size_t usage : label.usages)
+			object.relocations.push_back(Object::Relocation{ static_cast<uint32_t>(usage),
+				static_cast<uint32_t>(object.references.size()) });
+		object.references.push_back(name);
+	}
 
-	output.write(reinterpret_cast<char*>(program.data()), program.size());
+	for (const size_t operand : return_addresses)
+		object.relocations.push_back(Object::Relocation{ static_cast<uint32_t>(operand), Object::BASE });
 
-	output.close();
+	return object;
+}
+
+void Assembler::error(std::string msg)
+{
+	throw std::runtime_error(msg);
 }
@@ -2,70 +2,74 @@
 #define ASSEMBLER_HPP
 
 #include <cstdint>
-#include <fstream>
-#include <map>
+#include <memory>
 #include <string>
-#include <utility>
+#include <unordered_map>
 #include <vector>
 
+#include "Expression.hpp"
+#include "LabelTable.hpp"
+#include "Lexer.hpp"
+#include "Object.hpp"
+#include "../../image/Image.hpp"
+
 class Assembler
 {
 public:
-	Assembler(std::string source_path, std::string dest_path);
-	~Assembler();
-	
-	void assemble();
-	
+	explicit Assembler(std::string source_path);
+
+	Object assemble(); // Labels are left for the Linker
+
+	// Bumped whenever the same source would assemble into a different object
+	static const uint32_t VERSION = 1;
+
+	uint64_t get_source_hash() const;
+
 private:
-	template <class Key, class Value>
-	bool is_present_in_map(const std::map<Key, Value> *m, const Key key);
-	
-	void handle_operand(const std::string instr_name);
-	void reserve_space_for_label();
-	void put_labels_in_reserved_spaces();
-	void swap_endianness(int32_t* value);
-	void error(std::string msg);
-	void write_program();
-	
-	std::ifstream input;
-	std::string dest_path;
-	
-	std::vector<uint8_t> program;
-	
-	const int32_t INITIAL_ADDRESS = -1;
-	std::map<std::string, std::pair<std::vector<size_t>, int32_t>> labels;
-	/*
-	 * std::string - label's name;
-	 * std::vector - vector of label usages' locations;
-	 * int32_t - label declaration's address
-	*/
-	
-	const std::map<std::string, uint8_t> instrs = 
+	struct Macro
 	{
-		{"NOP",    0x00},
-		{"ADD",    0x01},
-		{"SUB",    0x02},
-		{"NEG",    0x03},
-		{"SHL",    0x04},
-		{"SHR",    0x05},
-		{"AND",    0x06},
-		{"OR",     0x07},
-		{"XOR",    0x08},
-		{"NOT",    0x09},
-		{"JMP",    0x0A},
-		{"JZ",     0x0B},
-		{"JNZ",    0x0C},
-		{"PUSH",   0x0D},
-		{"RM",     0x0E},
-		{"PUSHIP", 0x0F},
-		{"POPIP",  0x10},
-		{"RMIP",   0x11},
-		{"PUSHPM", 0x12},
-		{"POPPM",  0x13},
-		{"INPUT",  0x14},
-		{"PEEK",   0x15},
-		{"HALT",   0x16}
+		std::vector<Lexer::Token> params;
+		std::vector<Lexer::Token> body;
 	};
+
+	struct Expansion
+	{
+		const Macro *macro;
+		std::vector<Lexer::Token> args; // One per parameter
+		size_t next;
+	};
+
+	bool next_token(Lexer::Token &token); // From the innermost macro expansion, then the source
+	void unget_token(const Lexer::Token &token);
+
+	void define_macro(const Lexer::Token &directive);
+	void define_constant(const Lexer::Token &directive);
+	void define_byte(const Lexer::Token &directive);
+	void expand_macro(const Macro &macro, const Lexer::Token &invocation);
+
+	ExpressionValue evaluate(const Lexer::Token &token);
+	bool resolve(const char *name, const size_t length, const size_t scope, ExpressionValue &value);
+
+	void handle_operand(const Lexer::Token &instr);
+	void push_int32(const int32_t value);
+	Object make_object();
+	void error(std::string msg);
+
+	std::unique_ptr<Image> source; // Followed by a zero byte
+	Lexer lexer;
+
+	bool has_pending = false;
+	Lexer::Token pending;
+
+	std::unordered_map<std::string, Macro> macros;
+	std::unordered_map<std::string, int32_t> constants;
+	std::vector<Expansion> expansions; // Innermost last
+	static const size_t MAX_EXPANSION_DEPTH = 64;
+
+	std::vector<uint8_t> program;
+	std::vector<size_t> return_addresses; // Operands of CALL's first PUSH, relative to the object
+
+	LabelTable labels;
 };
 
 #endif // ASSEMBLER_H
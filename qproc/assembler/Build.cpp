@@ -0,0 +1,95 @@
+#include "Build.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+#include "Assembler.hpp"
+
+Build::Build(std::vector<std::string> sources, const bool incremental, const unsigned threads) :
+	sources(sources), incremental(incremental), threads(threads)
+{
+	if (this->threads == 0)
+		this->threads = std::max(1u, std::thread::hardware_concurrency());
+	this->threads = std::max<size_t>(1, std::min<size_t>(this->threads, this->sources.size()));
+}
+
+std::vector<Object> Build::run()
+{
+	std::vector<Object> objects(sources.size());
+	std::vector<std::string> errors(sources.size());
+	std::vector<char> reused(sources.size(), false);
+
+	// Sources are handed out one at a time, so a big one does not hold up the rest
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < sources.size(); i = next++)
+		{
+			try
+			{
+				bool was_reused = false;
+				objects[i] = build(sources[i], was_reused);
+				reused[i] = was_reused;
+			}
+			catch (const std::exception &ex)
+			{
+				errors[i] = ex.what();
+			}
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < threads; i++)
+		pool.emplace_back(worker);
+	worker();
+	for (std::thread &thread : pool)
+		thread.join();
+
+	std::string message;
+	for (size_t i = 0; i < sources.size(); i++)
+		if (!errors[i].empty())
+			message += (message.empty() ? "" : "\n") + (sources.size() > 1 ? sources[i] + ": " : "") + errors[i];
+	if (!message.empty())
+		throw std::runtime_error(message);
+
+	stats.threads = threads;
+	stats.up_to_date = std::count(reused.begin(), reused.end(), true);
+	stats.assembled = sources.size() - stats.up_to_date;
+
+	return objects;
+}
+
+std::string Build::object_path(const std::string source_path)
+{
+	return source_path + ".qpo";
+}
+
+Object Build::build(const std::string source_path, bool &reused) const
+{
+	Assembler assembler(source_path);
+
+	if (incremental)
+	{
+		try
+		{
+			Object object = Object::load(object_path(source_path));
+			if (object.source_hash == assembler.get_source_hash() && object.assembler_version == Assembler::VERSION)
+			{
+				reused = true;
+				return object;
+			}
+		}
+		catch (const std::runtime_error&)
+		{
+			// Missing or unreadable, made again below
+		}
+	}
+
+	Object object = assembler.assemble();
+	if (incremental)
+		object.save(object_path(source_path));
+
+	return object;
+}
@@ -0,0 +1,46 @@
+#ifndef BUILD_HPP
+#define BUILD_HPP
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "Object.hpp"
+
+struct BuildStats
+{
+	size_t assembled = 0;
+	size_t up_to_date = 0; // Reused object files
+	unsigned threads = 1;
+};
+
+/*
+ * Assembles sources into objects on several threads. With incremental set,
+ * every object is also written next to its source, and a source whose saved
+ * object was made from the same contents by the same assembler version is
+ * not assembled again. -O and --compact only act in the Linker, so objects
+ * do not depend on them.
+ */
+class Build
+{
+public:
+	// threads - 0 means one per hardware thread
+	Build(std::vector<std::string> sources, const bool incremental, const unsigned threads = 0);
+
+	std::vector<Object> run(); // In the order of the sources
+
+	const BuildStats &get_stats() const { return stats; }
+
+	static std::string object_path(const std::string source_path);
+
+private:
+	Object build(const std::string source_path, bool &reused) const;
+
+	std::vector<std::string> sources;
+	bool incremental;
+	unsigned threads;
+
+	BuildStats stats;
+};
+
+#endif
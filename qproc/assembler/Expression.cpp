@@ -0,0 +1,192 @@
+#include "Expression.hpp"
+
+#include <stdexcept>
+
+namespace
+{
+	const int LEVELS = 6; // | ^ & shifts additive multiplicative
+}
+
+Expression::Expression(const char *text, const size_t length, const Resolver &resolve) :
+	text(text), end(text + length), resolve(resolve)
+{}
+
+ExpressionValue Expression::evaluate(const char *text, const size_t length, const Resolver &resolve)
+{
+	Expression expression(text, length, resolve);
+
+	const ExpressionValue result = expression.parse_binary(0);
+	if (expression.text != expression.end)
+		error("Invalid expression");
+
+	return result;
+}
+
+bool Expression::is_operator(const char c)
+{
+	switch (c)
+	{
+	case '+': case '-': case '*': case '/': case '%': case '&': case '|':
+	case '^': case '~': case '<': case '>': case '(': case ')':
+		return true;
+	default:
+		return false;
+	}
+}
+
+ExpressionValue Expression::parse_binary(const int level)
+{
+	if (level == LEVELS)
+		return parse_unary();
+
+	ExpressionValue result = parse_binary(level + 1);
+	for (int length; (length = peek_operator(level)) != 0;)
+	{
+		const char op = *text;
+		text += length;
+		result = apply(op, result, parse_binary(level + 1));
+	}
+
+	return result;
+}
+
+ExpressionValue Expression::parse_unary()
+{
+	if (text != end && (*text == '-' || *text == '~'))
+	{
+		const char op = *text++;
+		ExpressionValue operand = parse_unary();
+		if (operand.label != nullptr)
+			error("A label can only be offset by a constant");
+
+		const uint32_t x = operand.value;
+		operand.value = static_cast<int32_t>(op == '-' ? 0u - x : ~x);
+		return operand;
+	}
+
+	return parse_primary();
+}
+
+ExpressionValue Expression::parse_primary()
+{
+	if (text == end)
+		error("Invalid expression");
+
+	if (*text == '(')
+	{
+		text++;
+		const ExpressionValue result = parse_binary(0);
+		if (text == end || *text != ')')
+			error("Missing closing parenthesis");
+		text++;
+		return result;
+	}
+
+	const char *start = text;
+	while (text != end && !is_operator(*text))
+		text++;
+	if (text == start)
+		error("Invalid expression");
+
+	ExpressionValue result;
+	if (*start >= '0' && *start <= '9')
+	{
+		const bool hex = text - start > 2 && start[0] == '0' && (start[1] == 'x' || start[1] == 'X');
+		uint64_t number = 0;
+		for (const char *c = hex ? start + 2 : start; c != text; c++)
+		{
+			int digit;
+			if (*c >= '0' && *c <= '9')
+				digit = *c - '0';
+			else if (hex && *c >= 'a' && *c <= 'f')
+				digit = *c - 'a' + 10;
+			else if (hex && *c >= 'A' && *c <= 'F')
+				digit = *c - 'A' + 10;
+			else
+				error("Unknown symbol");
+
+			number = number * (hex ? 16 : 10) + digit;
+			if (number > UINT32_MAX)
+				error("Integer is too big");
+		}
+		result.value = static_cast<int32_t>(static_cast<uint32_t>(number));
+	}
+	else if (!resolve(start, text - start, result))
+	{
+		result.label = start;
+		result.label_length = text - start;
+	}
+
+	return result;
+}
+
+ExpressionValue Expression::apply(const char op, const ExpressionValue &a, const ExpressionValue &b)
+{
+	ExpressionValue result;
+
+	if (a.label != nullptr || b.label != nullptr)
+	{
+		if (op == '+' && (a.label == nullptr || b.label == nullptr))
+		{
+			const ExpressionValue &label = a.label != nullptr ? a : b;
+			result.label = label.label;
+			result.label_length = label.label_length;
+		}
+		else if (op == '-' && b.label == nullptr)
+		{
+			result.label = a.label;
+			result.label_length = a.label_length;
+		}
+		else
+			error("A label can only be offset by a constant");
+	}
+
+	const uint32_t x = a.value, y = b.value;
+	switch (op)
+	{
+	case '+': result.value = static_cast<int32_t>(x + y); break;
+	case '-': result.value = static_cast<int32_t>(x - y); break;
+	case '*': result.value = static_cast<int32_t>(x * y); break;
+	case '&': result.value = static_cast<int32_t>(x & y); break;
+	case '|': result.value = static_cast<int32_t>(x | y); break;
+	case '^': result.value = static_cast<int32_t>(x ^ y); break;
+	case '/':
+	case '%':
+		if (b.value == 0)
+			error("Division by zero");
+		result.value = static_cast<int32_t>(op == '/' ? static_cast<int64_t>(a.value) / b.value :
+			static_cast<int64_t>(a.value) % b.value);
+		break;
+	case '<':
+	case '>':
+		if (b.value < 0 || b.value > 31)
+			error("Shift out of range");
+		result.value = op == '<' ? static_cast<int32_t>(x << b.value) : a.value >> b.value;
+		break;
+	}
+
+	return result;
+}
+
+int Expression::peek_operator(const int level) const
+{
+	if (text == end)
+		return 0;
+
+	const char c = *text;
+	switch (level)
+	{
+	case 0: return c == '|';
+	case 1: return c == '^';
+	case 2: return c == '&';
+	case 3: return end - text >= 2 && (c == '<' || c == '>') && text[1] == c ? 2 : 0;
+	case 4: return c == '+' || c == '-';
+	case 5: return c == '*' || c == '/' || c == '%';
+	default: return 0;
+	}
+}
+
+void Expression::error(const char *msg)
+{
+	throw std::runtime_error(msg);
+}
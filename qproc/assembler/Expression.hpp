@@ -0,0 +1,47 @@
+#ifndef EXPRESSION_HPP
+#define EXPRESSION_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+
+struct ExpressionValue
+{
+	int32_t value = 0; // The offset from the label if there is one
+	const char *label = nullptr; // nullptr - a plain constant
+	size_t label_length = 0;
+};
+
+/*
+ * Constant expressions written without spaces, e.g. VIDEO_BASE+320*(Y+1).
+ * C operators and precedence: unary - ~, then * / %, + -, << >>, &, ^, |.
+ * Numbers are decimal or 0x hexadecimal, arithmetic wraps around at 32 bits.
+ * A label can only be offset by a constant, the linker adds its address.
+ */
+class Expression
+{
+public:
+	// Sets value and returns true for a known name, returns false for a label
+	typedef std::function<bool(const char *name, const size_t length, ExpressionValue &value)> Resolver;
+
+	static ExpressionValue evaluate(const char *text, const size_t length, const Resolver &resolve);
+
+	static bool is_operator(const char c);
+
+private:
+	Expression(const char *text, const size_t length, const Resolver &resolve);
+
+	ExpressionValue parse_binary(const int level);
+	ExpressionValue parse_unary();
+	ExpressionValue parse_primary();
+
+	static ExpressionValue apply(const char op, const ExpressionValue &a, const ExpressionValue &b);
+	int peek_operator(const int level) const; // Length of the operator of the level, 0 if none
+	[[noreturn]] static void error(const char *msg);
+
+	const char *text;
+	const char *end;
+	const Resolver &resolve;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#include "LabelTable.hpp"
+
+#include <cstring>
+
+LabelTable::LabelTable() :
+	slots(256, 0)
+{}
+
+LabelTable::Label &LabelTable::get(const char *name, const size_t length)
+{
+	size_t slot = find_slot(name, length);
+	if (slots[slot] != 0)
+		return labels[slots[slot] - 1];
+
+	if ((labels.size() + 1) * 2 > slots.size()) // Keep the load factor under 1/2
+	{
+		grow();
+		slot = find_slot(name, length);
+	}
+
+	labels.push_back(Label{ name, length, UNDECLARED, std::vector<size_t>() });
+	slots[slot] = labels.size();
+
+	return labels.back();
+}
+
+const LabelTable::Label *LabelTable::find(const char *name, const size_t length) const
+{
+	const size_t slot = find_slot(name, length);
+	return slots[slot] != 0 ? &labels[slots[slot] - 1] : nullptr;
+}
+
+uint32_t LabelTable::hash(const char *name, const size_t length)
+{
+	uint32_t result = 2166136261u; // FNV-1a
+	for (size_t i = 0; i < length; i++)
+		result = (result ^ static_cast<uint8_t>(name[i])) * 16777619u;
+
+	return result;
+}
+
+size_t LabelTable::find_slot(const char *name, const size_t length) const
+{
+	const size_t mask = slots.size() - 1;
+
+	for (size_t slot = hash(name, length) & mask;; slot = (slot + 1) & mask)
+	{
+		if (slots[slot] == 0)
+			return slot;
+
+		const Label &label = labels[slots[slot] - 1];
+		if (label.length == length && std::memcmp(label.name, name, length) == 0)
+			return slot;
+	}
+}
+
+void LabelTable::grow()
+{
+	slots.assign(slots.size() * 2, 0);
+
+	const size_t mask = slots.size() - 1;
+	for (size_t i = 0; i < labels.size(); i++)
+	{
+		size_t slot = hash(labels[i].name, labels[i].length) & mask;
+		while (slots[slot] != 0)
+			slot = (slot + 1) & mask;
+		slots[slot] = i + 1;
+	}
+}
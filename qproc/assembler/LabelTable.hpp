@@ -0,0 +1,44 @@
+#ifndef LABELTABLE_HPP
+#define LABELTABLE_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/*
+ * Open-addressing hash table of labels. Names are not copied: they point
+ * into the source buffer, which outlives the table. Labels are kept in
+ * insertion order, the hash slots only hold indices into that list.
+ */
+class LabelTable
+{
+public:
+	static const int32_t UNDECLARED = -1;
+
+	struct Label
+	{
+		const char *name;
+		size_t length;
+		int32_t address; // UNDECLARED until the declaration is seen
+		std::vector<size_t> usages; // Program offsets of the operands referring to the label
+	};
+
+	LabelTable();
+
+	Label &get(const char *name, const size_t length); // Adds an undeclared label if there is none
+	const Label *find(const char *name, const size_t length) const;
+
+	std::vector<Label> &all() { return labels; }
+	const std::vector<Label> &all() const { return labels; }
+
+private:
+	static uint32_t hash(const char *name, const size_t length);
+	size_t find_slot(const char *name, const size_t length) const;
+	void grow();
+
+	std::vector<Label> labels;
+	std::vector<uint32_t> slots; // Index into labels + 1, 0 - empty; the size is a power of 2
+};
+
+#endif
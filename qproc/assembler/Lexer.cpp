@@ -0,0 +1,195 @@
+#include "Lexer.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+	bool is_space(const char c)
+	{
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+	}
+
+	bool is_digit(const char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+
+	bool equals(const char *text, const size_t length, const char *word)
+	{
+		return std::strlen(word) == length && std::memcmp(text, word, length) == 0;
+	}
+}
+
+Lexer::Lexer(const char *source) :
+	cursor(source), line_start(source)
+{}
+
+bool Lexer::next(Token &token)
+{
+	skip_whitespace_and_comments();
+
+	token.line = line;
+	token.column = cursor - line_start + 1;
+	token.scope = 0;
+	token.text = cursor;
+
+	if (*cursor == '\0') // The source buffer is zero-terminated
+	{
+		token.kind = Token::End;
+		token.length = 0;
+		return false;
+	}
+
+	while (*cursor != '\0' && !is_space(*cursor) && !(cursor[0] == '/' && cursor[1] == '*'))
+		cursor++;
+	token.length = cursor - token.text;
+
+	if (token.text[token.length - 1] == ':')
+	{
+		token.kind = Token::LabelDecl;
+		token.length--;
+		return true;
+	}
+
+	token.mnemonic = find_mnemonic(token.text, token.length);
+	if (token.mnemonic != NOT_A_MNEMONIC)
+	{
+		token.kind = Token::Instruction;
+		return true;
+	}
+
+	// integer = ["-" | "+"], digit, {digit}
+	size_t pos = token.text[0] == '-' || token.text[0] == '+' ? 1 : 0;
+	if (pos == token.length || !is_digit(token.text[pos]))
+	{
+		token.kind = Token::Name;
+		return true;
+	}
+
+	const size_t digits_start = pos;
+	while (pos < token.length && is_digit(token.text[pos]))
+		pos++;
+	if (pos != token.length) // E.g. 320*Y
+	{
+		token.kind = Token::Name;
+		return true;
+	}
+
+	int64_t integer = 0;
+	for (pos = digits_start; pos < token.length; pos++)
+	{
+		integer = integer * 10 + (token.text[pos] - '0');
+		if (integer > static_cast<int64_t>(INT32_MAX) + 1)
+			error("Integer is too big", token.line, token.column);
+	}
+
+	if (token.text[0] == '-')
+		integer = -integer;
+	if (integer > INT32_MAX)
+		error("Integer is too big", token.line, token.column);
+
+	token.kind = Token::Integer;
+	token.value = static_cast<int32_t>(integer);
+	return true;
+}
+
+int Lexer::find_mnemonic(const char *text, const size_t length)
+{
+	// The length and the first character leave at most three candidates
+	const char *t = text;
+	const size_t len = length;
+
+	switch (len)
+	{
+	case 2:
+		switch (t[0])
+		{
+		case 'O': return equals(t, len, "OR") ? OR : NOT_A_MNEMONIC;
+		case 'J': return equals(t, len, "JZ") ? JZ : NOT_A_MNEMONIC;
+		case 'R': return equals(t, len, "RM") ? RM : NOT_A_MNEMONIC;
+		}
+		break;
+	case 3:
+		switch (t[0])
+		{
+		case 'A':
+			return equals(t, len, "ADD") ? ADD : equals(t, len, "AND") ? AND : NOT_A_MNEMONIC;
+		case 'N':
+			return equals(t, len, "NOP") ? NOP : equals(t, len, "NEG") ? NEG :
+				equals(t, len, "NOT") ? NOT : NOT_A_MNEMONIC;
+		case 'S':
+			return equals(t, len, "SUB") ? SUB : equals(t, len, "SHL") ? SHL :
+				equals(t, len, "SHR") ? SHR : NOT_A_MNEMONIC;
+		case 'X':
+			return equals(t, len, "XOR") ? XOR : NOT_A_MNEMONIC;
+		case 'J':
+			return equals(t, len, "JMP") ? JMP : equals(t, len, "JNZ") ? JNZ : NOT_A_MNEMONIC;
+		}
+		break;
+	case 4:
+		switch (t[0])
+		{
+		case 'P':
+			return equals(t, len, "PUSH") ? PUSH : equals(t, len, "PEEK") ? PEEK : NOT_A_MNEMONIC;
+		case 'R': return equals(t, len, "RMIP") ? RMIP : NOT_A_MNEMONIC;
+		case 'H': return equals(t, len, "HALT") ? HALT : NOT_A_MNEMONIC;
+		case 'C': return equals(t, len, "CALL") ? CALL : NOT_A_MNEMONIC;
+		}
+		break;
+	case 5:
+		switch (t[0])
+		{
+		case 'P':
+			return equals(t, len, "POPIP") ? POPIP : equals(t, len, "POPPM") ? POPPM : NOT_A_MNEMONIC;
+		case 'I': return equals(t, len, "INPUT") ? INPUT : NOT_A_MNEMONIC;
+		}
+		break;
+	case 6:
+		return equals(t, len, "PUSHIP") ? PUSHIP : equals(t, len, "PUSHPM") ? PUSHPM : NOT_A_MNEMONIC;
+	}
+
+	return NOT_A_MNEMONIC;
+}
+
+std::string Lexer::position(const Token &token)
+{
+	return " at line " + std::to_string(token.line) + ", column " + std::to_string(token.column);
+}
+
+void Lexer::skip_whitespace_and_comments()
+{
+	for (;;)
+	{
+		if (*cursor == '\n')
+		{
+			line++;
+			line_start = ++cursor;
+		}
+		else if (is_space(*cursor))
+			cursor++;
+		else if (cursor[0] == '/' && cursor[1] == '*')
+		{
+			const size_t comment_line = line, comment_column = cursor - line_start + 1;
+
+			for (cursor += 2; !(cursor[0] == '*' && cursor[1] == '/'); cursor++)
+			{
+				if (*cursor == '\0')
+					error("Unterminated comment", comment_line, comment_column);
+				if (*cursor == '\n')
+				{
+					line++;
+					line_start = cursor + 1;
+				}
+			}
+			cursor += 2;
+		}
+		else
+			return;
+	}
+}
+
+void Lexer::error(const std::string msg, const size_t line, const size_t column) const
+{
+	throw std::runtime_error(msg + " at line " + std::to_string(line) + ", column " + std::to_string(column));
+}
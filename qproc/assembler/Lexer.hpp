@@ -0,0 +1,59 @@
+#ifndef LEXER_HPP
+#define LEXER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Splits zero-terminated QProc assembly into tokens in a single pass without
+ * allocating. Comments are skipped like whitespace and may also end a token,
+ * so a comment written right after HALT still leaves a HALT. Token text
+ * points into the source buffer.
+ */
+class Lexer
+{
+public:
+	enum Mnemonic
+	{
+		NOP = 0x00, ADD = 0x01, SUB = 0x02, NEG = 0x03, SHL = 0x04, SHR = 0x05,
+		AND = 0x06, OR = 0x07, XOR = 0x08, NOT = 0x09, JMP = 0x0A, JZ = 0x0B,
+		JNZ = 0x0C, PUSH = 0x0D, RM = 0x0E, PUSHIP = 0x0F, POPIP = 0x10, RMIP = 0x11,
+		PUSHPM = 0x12, POPPM = 0x13, INPUT = 0x14, PEEK = 0x15, HALT = 0x16,
+		CALL = 0x100, // Not an opcode, expands into PUSH ret; PUSHIP; PUSH target; JMP
+		NOT_A_MNEMONIC = -1
+	};
+
+	struct Token
+	{
+		enum Kind { End, Instruction, LabelDecl, Integer, Name }; // Name - a label, directive or expression
+
+		Kind kind;
+		const char *text; // For LabelDecl - without the colon
+		size_t length;
+		size_t line, column; // 1-based
+
+		int mnemonic; // Instruction
+		int32_t value; // Integer
+
+		size_t scope; // Macro expansion the token came from, 0 - the source itself
+	};
+
+	explicit Lexer(const char *source);
+
+	bool next(Token &token); // false at the end of the source
+
+	static int find_mnemonic(const char *text, const size_t length);
+
+	static std::string position(const Token &token); // " at line L, column C"
+
+private:
+	void skip_whitespace_and_comments();
+	void error(const std::string msg, const size_t line, const size_t column) const;
+
+	const char *cursor;
+	const char *line_start;
+	size_t line = 1;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "Linker.hpp"
+
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+Linker::Linker(std::string dest_path, const bool optimize, const bool compact) :
+	dest_path(dest_path), optimize(optimize), compact(compact)
+{}
+
+void Linker::add(const std::string name, Object object)
+{
+	names.push_back(name);
+	objects.push_back(std::move(object));
+}
+
+void Linker::link()
+{
+	for (const Object &object : objects)
+	{
+		bases.push_back(program.size());
+		program.insert(program.end(), object.code.begin(), object.code.end());
+	}
+
+	for (size_t i = 0; i < objects.size(); i++)
+		for (const Object::Symbol &symbol : objects[i].symbols)
+		{
+			LabelTable::Label &label = labels.get(symbol.name.data(), symbol.name.size());
+			if (label.address != LabelTable::UNDECLARED)
+				error("Label redeclaration (" + symbol.name + " in " + names[i] + ")");
+			label.address = bases[i] + symbol.offset;
+		}
+
+	put_labels_in_reserved_spaces();
+
+	if (optimize || compact)
+		optimizer_stats = Optimizer(program, labels).run(optimize, compact);
+
+	write_program();
+	write_symbols();
+}
+
+void Linker::put_labels_in_reserved_spaces()
+{
+	for (size_t i = 0; i < objects.size(); i++)
+		for (const Object::Relocation &relocation : objects[i].relocations)
+		{
+			const size_t operand = bases[i] + relocation.offset;
+
+			// The operand holds an offset, e.g. 4 for LABEL+4
+			uint32_t value = 0;
+			for (size_t byte = 0; byte < sizeof(int32_t); byte++)
+				value = value << 8 | program[operand + byte];
+
+			if (relocation.reference == Object::BASE)
+				value += bases[i];
+			else
+			{
+				const std::string &name = objects[i].references[relocation.reference];
+				LabelTable::Label &label = labels.get(name.data(), name.size());
+				if (label.address == LabelTable::UNDECLARED)
+					error("Label used without a declaration (" + name + " in " + names[i] + ")");
+
+				label.usages.push_back(operand);
+				value += label.address;
+			}
+
+			for (size_t byte = 0; byte < sizeof(int32_t); byte++)
+				program[operand + byte] = static_cast<uint8_t>(value >> (24 - 8 * byte));
+		}
+}
+
+void Linker::error(std::string msg)
+{
+	throw std::runtime_error(msg);
+}
+
+void Linker::write_program()
+{
+	const int MAX_PROG_SIZE = 204800;
+	if (program.size() > MAX_PROG_SIZE)
+		error("Resulting program's size is bigger than MAX_PROG_SIZE");
+
+	std::ofstream output;
+	output.open(dest_path, std::ios::binary | std::ios::trunc);
+	if (!output.is_open())
+		error("Could not open ROM");
+
+	output.write(reinterpret_cast<char*>(program.data()), program.size());
+
+	output.close();
+}
+
+void Linker::write_symbols()
+{
+	std::multimap<int32_t, std::string> by_address;
+	for (const auto &label : labels.all())
+		by_address.emplace(label.address, std::string(label.name, label.length));
+
+	std::ofstream output;
+	output.open(dest_path + ".sym", std::ios::trunc);
+	if (!output.is_open())
+		error("Could not open the symbol file");
+
+	for (const auto &symbol : by_address)
+		output << symbol.first << " " << symbol.second << std::endl;
+
+	output.close();
+}
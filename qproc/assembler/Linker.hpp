@@ -0,0 +1,46 @@
+#ifndef LINKER_HPP
+#define LINKER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "LabelTable.hpp"
+#include "Object.hpp"
+#include "Optimizer.hpp"
+
+/*
+ * Places objects one after another in the order they were added, as if their
+ * sources were concatenated: labels are shared between all of them.
+ */
+class Linker
+{
+public:
+	Linker(std::string dest_path, const bool optimize = false, const bool compact = false);
+
+	void add(const std::string name, Object object); // name - for error messages
+	void link(); // Writes the ROM and its symbol file
+
+	const OptimizerStats &get_optimizer_stats() const { return optimizer_stats; }
+
+private:
+	void put_labels_in_reserved_spaces();
+	void error(std::string msg);
+	void write_program();
+	void write_symbols(); // "address label" lines for the emulator's profiler, dest_path + ".sym"
+
+	std::string dest_path;
+	bool optimize;
+	bool compact; // Use the compact encoding, see Optimizer
+
+	std::vector<std::string> names;
+	std::vector<Object> objects; // Label names in the table point into these
+	std::vector<uint32_t> bases;
+
+	std::vector<uint8_t> program;
+	LabelTable labels;
+
+	OptimizerStats optimizer_stats;
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include "Object.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace
+{
+	const char MAGIC[4] = { 'Q', 'P', 'O', 'B' };
+
+	void put32(std::vector<uint8_t> &out, const uint32_t value)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(static_cast<uint8_t>(value >> shift));
+	}
+
+	void put64(std::vector<uint8_t> &out, const uint64_t value)
+	{
+		put32(out, static_cast<uint32_t>(value >> 32));
+		put32(out, static_cast<uint32_t>(value));
+	}
+
+	void put_name(std::vector<uint8_t> &out, const std::string &name)
+	{
+		put32(out, name.size());
+		out.insert(out.end(), name.begin(), name.end());
+	}
+
+	class Reader
+	{
+	public:
+		Reader(const std::vector<uint8_t> &data, const std::string &filename) :
+			data(data), filename(filename)
+		{}
+
+		uint32_t get32()
+		{
+			need(4);
+			uint32_t value = 0;
+			for (int i = 0; i < 4; i++)
+				value = (value << 8) | data[pos++];
+			return value;
+		}
+
+		uint64_t get64()
+		{
+			const uint64_t high = get32();
+			return (high << 32) | get32();
+		}
+
+		const uint8_t *take(const size_t size)
+		{
+			need(size);
+			const uint8_t *ptr = data.data() + pos;
+			pos += size;
+			return ptr;
+		}
+
+		std::string get_name()
+		{
+			const uint32_t length = get32();
+			return std::string(reinterpret_cast<const char*>(take(length)), length);
+		}
+
+		void need(const uint64_t size) const
+		{
+			if (data.size() - pos < size)
+				corrupt();
+		}
+
+		void corrupt() const
+		{
+			throw std::runtime_error("Corrupt object file (" + filename + ")");
+		}
+
+	private:
+		const std::vector<uint8_t> &data;
+		const std::string &filename;
+		size_t pos = 0;
+	};
+}
+
+void Object::save(const std::string filename) const
+{
+	std::vector<uint8_t> out(MAGIC, MAGIC + sizeof(MAGIC));
+	put32(out, VERSION);
+	put32(out, assembler_version);
+	put64(out, source_hash);
+
+	put32(out, code.size());
+	out.insert(out.end(), code.begin(), code.end());
+
+	put32(out, symbols.size());
+	for (const Symbol &symbol : symbols)
+	{
+		put_name(out, symbol.name);
+		put32(out, symbol.offset);
+	}
+
+	put32(out, references.size());
+	for (const std::string &reference : references)
+		put_name(out, reference);
+
+	put32(out, relocations.size());
+	for (const Relocation &relocation : relocations)
+	{
+		put32(out, relocation.offset);
+		put32(out, relocation.reference);
+	}
+
+	// Written aside and renamed, so that a parallel build never reads half an object
+	const std::string tmp_filename = filename + ".tmp";
+	{
+		std::ofstream file(tmp_filename, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			throw std::runtime_error("Could not open the object file (" + filename + ")");
+		if (!file.write(reinterpret_cast<const char*>(out.data()), out.size()))
+			throw std::runtime_error("Could not write the object file (" + filename + ")");
+	}
+
+	if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("Could not replace the object file (" + filename + ")");
+}
+
+Object Object::load(const std::string filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		throw std::runtime_error("Could not open the object file (" + filename + ")");
+	const std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	Reader in(data, filename);
+	if (std::memcmp(in.take(sizeof(MAGIC)), MAGIC, sizeof(MAGIC)) != 0 || in.get32() != VERSION)
+		throw std::runtime_error("Not a QProc object file of this version (" + filename + ")");
+
+	Object object;
+	object.assembler_version = in.get32();
+	object.source_hash = in.get64();
+
+	const uint32_t code_size = in.get32();
+	const uint8_t *code = in.take(code_size);
+	object.code.assign(code, code + code_size);
+
+	const uint32_t symbols_num = in.get32();
+	for (uint32_t i = 0; i < symbols_num; i++)
+	{
+		Symbol symbol;
+		symbol.name = in.get_name();
+		symbol.offset = in.get32();
+		if (symbol.offset > code_size)
+			in.corrupt();
+		object.symbols.push_back(symbol);
+	}
+
+	const uint32_t references_num = in.get32();
+	for (uint32_t i = 0; i < references_num; i++)
+		object.references.push_back(in.get_name());
+
+	const uint32_t relocations_num = in.get32();
+	for (uint32_t i = 0; i < relocations_num; i++)
+	{
+		Relocation relocation;
+		relocation.offset = in.get32();
+		relocation.reference = in.get32();
+		if (code_size < sizeof(int32_t) || relocation.offset > code_size - sizeof(int32_t) ||
+			(relocation.reference != BASE && relocation.reference >= references_num))
+			in.corrupt();
+		object.relocations.push_back(relocation);
+	}
+
+	return object;
+}
+
+uint64_t Object::hash(const uint8_t *data, const size_t size)
+{
+	uint64_t result = 14695981039346656037ull; // FNV-1a
+	for (size_t i = 0; i < size; i++)
+		result = (result ^ data[i]) * 1099511628211ull;
+
+	return result;
+}
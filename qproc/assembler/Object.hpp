@@ -0,0 +1,51 @@
+#ifndef OBJECT_HPP
+#define OBJECT_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/*
+ * One assembled source file before linking. Code addresses are relative to
+ * the start of the object until the linker places it.
+ *
+ * Object file, all numbers are big-endian:
+ * "QPOB", version, assembler version, source hash, code size and bytes,
+ * symbols as (name, offset), referenced names, relocations as
+ * (offset, reference index or BASE).
+ * A name is its length followed by the characters.
+ */
+struct Object
+{
+	static const uint32_t BASE = 0xFFFFFFFF; // Add the object's address to the operand
+
+	struct Symbol
+	{
+		std::string name;
+		uint32_t offset;
+	};
+
+	struct Relocation
+	{
+		uint32_t offset; // Of the 32-bit operand in code
+		uint32_t reference; // Index into references or BASE
+	};
+
+	uint32_t assembler_version = 0;
+	uint64_t source_hash = 0;
+	std::vector<uint8_t> code;
+	std::vector<Symbol> symbols; // Labels declared in the source, in order of first appearance
+	std::vector<std::string> references; // Labels the code refers to
+	std::vector<Relocation> relocations;
+
+	void save(const std::string filename) const;
+	static Object load(const std::string filename);
+
+	static uint64_t hash(const uint8_t *data, const size_t size);
+
+private:
+	static const uint32_t VERSION = 3;
+};
+
+#endif
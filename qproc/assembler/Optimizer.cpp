@@ -0,0 +1,524 @@
+#include "Optimizer.hpp"
+
+#include "Lexer.hpp"
+
+namespace
+{
+	// Compact encoding, displacements are relative to the next instruction
+	enum CompactOpcode
+	{
+		PUSH8 = 0x17,
+		PUSH16 = 0x18,
+		JMPREL8 = 0x19,
+		JMPREL16 = 0x1A,
+		JZREL8 = 0x1B,
+		JNZREL8 = 0x1C,
+		JZREL16 = 0x1D,
+		JNZREL16 = 0x1E,
+		CALLREL16 = 0x1F
+	};
+
+	bool fits(const int64_t value, const size_t bytes)
+	{
+		const int64_t limit = int64_t(1) << (8 * bytes - 1);
+		return value >= -limit && value < limit;
+	}
+}
+
+Optimizer::Optimizer(std::vector<uint8_t> &program, LabelTable &labels) :
+	program(program), labels(labels)
+{}
+
+OptimizerStats Optimizer::run(const bool peephole, const bool compact)
+{
+	stats.bytes_before = stats.bytes_after = program.size();
+
+	if (!decode())
+		return stats;
+
+	mark_frozen();
+
+	bool changed = peephole;
+	while (changed)
+	{
+		changed = false;
+		changed |= remove_dead_code();
+		changed |= strip_nops();
+		changed |= fold_constants();
+		changed |= thread_jumps();
+	}
+
+	encode(compact);
+
+	return stats;
+}
+
+bool Optimizer::decode()
+{
+	const std::vector<LabelTable::Label> &all = labels.all();
+
+	std::vector<int> label_at(program.size(), -1); // Label referred to by the operand at an offset
+	for (size_t i = 0; i < all.size(); i++)
+		for (const size_t usage : all[i].usages)
+			label_at[usage] = i;
+
+	std::vector<int> index_of(program.size() + 1, -1); // Instruction index by address
+	for (size_t addr = 0; addr < program.size();)
+	{
+		index_of[addr] = instrs.size();
+
+		Instr instr = { program[addr], 0, -1, false };
+		if (instr.op == Lexer::PUSH && addr + sizeof(int32_t) >= program.size())
+		{
+			stats.skipped = "the PUSH at address " + std::to_string(addr) + " has no operand";
+			return false;
+		}
+		if (instr.op == Lexer::PUSH)
+		{
+			uint32_t operand = 0;
+			for (size_t i = 1; i <= sizeof(int32_t); i++)
+				operand = operand << 8 | program[addr + i];
+			instr.operand = static_cast<int32_t>(operand);
+			instr.target = label_at[addr + 1];
+			if (instr.target != -1)
+				instr.operand -= all[instr.target].address; // Keep only the offset, e.g. 4 for LABEL+4
+
+			addr += 1 + sizeof(int32_t);
+		}
+		else
+			addr++;
+
+		instrs.push_back(instr);
+	}
+	index_of[program.size()] = instrs.size();
+
+	// .byte data is decoded as instructions too, so labels may end up inside them
+	for (const auto &label : all)
+	{
+		if (index_of[label.address] == -1)
+		{
+			stats.skipped = "label " + std::string(label.name, label.length) + " is inside an instruction";
+			return false;
+		}
+		for (const size_t usage : label.usages)
+			if (index_of[usage - 1] == -1 || program[usage - 1] != Lexer::PUSH)
+			{
+				stats.skipped = "label " + std::string(label.name, label.length) + " is used inside an instruction";
+				return false;
+			}
+
+		anchors.push_back(index_of[label.address]);
+	}
+
+	// Integers used as code addresses, e.g. CALL's return address
+	for (size_t i = 0; i + 1 < instrs.size(); i++)
+	{
+		Instr &instr = instrs[i];
+		if (instr.op != Lexer::PUSH || instr.target != -1 || !uses_code_address(instrs[i + 1].op) ||
+			instr.operand < 0 || static_cast<size_t>(instr.operand) > program.size())
+			continue;
+
+		if (index_of[instr.operand] == -1)
+		{
+			stats.skipped = "a jump to address " + std::to_string(instr.operand) + " lands inside an instruction";
+			return false;
+		}
+
+		anchors.push_back(index_of[instr.operand]);
+		instr.target = anchors.size() - 1;
+		instr.operand = 0;
+	}
+
+	anchor_count.assign(instrs.size() + 1, 0);
+	for (const size_t anchor : anchors)
+		anchor_count[anchor]++;
+
+	return true;
+}
+
+void Optimizer::mark_frozen()
+{
+	std::vector<bool> is_data(anchors.size(), false);
+	for (size_t i = 0; i < instrs.size(); i++)
+		if (instrs[i].target != -1 && (instrs[i].operand != 0 ||
+			i + 1 == instrs.size() || !uses_code_address(instrs[i + 1].op)))
+			is_data[instrs[i].target] = true;
+
+	for (size_t a = 0; a < anchors.size(); a++)
+	{
+		if (!is_data[a] || anchors[a] == instrs.size())
+			continue;
+
+		size_t i = anchors[a];
+		do
+			instrs[i++].frozen = true;
+		while (i < instrs.size() && !is_anchored(i));
+	}
+}
+
+bool Optimizer::strip_nops()
+{
+	std::vector<bool> removed(instrs.size(), false);
+	bool changed = false;
+
+	for (size_t i = 0; i < instrs.size(); i++)
+		if (instrs[i].op == Lexer::NOP && !instrs[i].frozen)
+		{
+			removed[i] = changed = true;
+			stats.cycles_saved++;
+		}
+
+	if (changed)
+		remove(removed);
+
+	return changed;
+}
+
+bool Optimizer::fold_constants()
+{
+	std::vector<bool> removed(instrs.size(), false);
+	bool changed = false;
+
+	// The instructions after the first one of a pattern should not be jumped to
+	auto free = [&](const size_t first, const size_t count)
+	{
+		if (first + count > instrs.size())
+			return false;
+		for (size_t i = first; i < first + count; i++)
+			if (removed[i] || instrs[i].frozen || (i != first && is_anchored(i)))
+				return false;
+		return true;
+	};
+	auto drop = [&](const size_t first, const size_t count)
+	{
+		for (size_t i = first; i < first + count; i++)
+			removed[i] = true;
+		stats.cycles_saved += count;
+		changed = true;
+	};
+
+	for (size_t i = 0; i < instrs.size(); i++)
+	{
+		if (!free(i, 2))
+			continue;
+
+		const uint8_t op = instrs[i].op, next = instrs[i + 1].op;
+
+		// PUSH a; PUSH b; <binop> -> PUSH (a <binop> b)
+		if (is_plain_push(i) && is_plain_push(i + 1) && free(i, 3))
+		{
+			const int32_t a = instrs[i].operand, b = instrs[i + 1].operand;
+			const uint32_t x = a, y = b;
+
+			bool folded = true;
+			uint32_t result = 0;
+			switch (instrs[i + 2].op)
+			{
+			case Lexer::ADD: result = x + y; break;
+			case Lexer::SUB: result = x - y; break;
+			case Lexer::AND: result = x & y; break;
+			case Lexer::OR: result = x | y; break;
+			case Lexer::XOR: result = x ^ y; break;
+			case Lexer::SHL: folded = b >= 0 && b < 32; result = folded ? x << b : 0; break;
+			case Lexer::SHR: folded = b >= 0 && b < 32; result = folded ? a >> b : 0; break;
+			default: folded = false;
+			}
+
+			if (folded)
+			{
+				instrs[i].operand = static_cast<int32_t>(result);
+				drop(i + 1, 2);
+				i += 2;
+				continue;
+			}
+		}
+
+		// PUSH a; NEG / NOT -> PUSH -a / ~a
+		if (is_plain_push(i) && (next == Lexer::NEG || next == Lexer::NOT))
+		{
+			const uint32_t x = instrs[i].operand;
+			instrs[i].operand = static_cast<int32_t>(next == Lexer::NEG ? 0u - x : ~x);
+			drop(i + 1, 1);
+			i++;
+		}
+		// NEG; NEG and NOT; NOT cancel out, so do PUSH x; RM
+		else if ((op == next && (op == Lexer::NEG || op == Lexer::NOT)) ||
+			(op == Lexer::PUSH && next == Lexer::RM))
+		{
+			drop(i, 2);
+			i++;
+		}
+		// PUSH 0; ADD / SUB / OR / XOR / SHL / SHR leave the top as is
+		else if (is_plain_push(i) && instrs[i].operand == 0 &&
+			(next == Lexer::ADD || next == Lexer::SUB || next == Lexer::OR ||
+			next == Lexer::XOR || next == Lexer::SHL || next == Lexer::SHR))
+		{
+			drop(i, 2);
+			i++;
+		}
+	}
+
+	if (changed)
+		remove(removed);
+
+	return changed;
+}
+
+bool Optimizer::remove_dead_code()
+{
+	std::vector<bool> removed(instrs.size(), false);
+	bool changed = false;
+
+	for (size_t i = 0; i < instrs.size(); i++)
+	{
+		const uint8_t op = instrs[i].op;
+		if (instrs[i].frozen || (op != Lexer::JMP && op != Lexer::POPIP && op != Lexer::HALT))
+			continue;
+
+		// Nothing falls through, so only an anchor makes the following code reachable
+		for (; i + 1 < instrs.size() && !is_anchored(i + 1) && !instrs[i + 1].frozen; i++)
+			removed[i + 1] = changed = true;
+	}
+
+	if (changed)
+		remove(removed);
+
+	return changed;
+}
+
+bool Optimizer::thread_jumps()
+{
+	std::vector<bool> removed(instrs.size(), false);
+	bool changed = false;
+
+	for (size_t i = 0; i + 1 < instrs.size(); i++)
+	{
+		Instr &push = instrs[i];
+		const uint8_t jump = instrs[i + 1].op;
+		if (push.op != Lexer::PUSH || push.target == -1 || push.operand != 0 || push.frozen ||
+			(jump != Lexer::JMP && jump != Lexer::JZ && jump != Lexer::JNZ))
+			continue;
+
+		// Follow "PUSH target; JMP" chains, giving up on cycles
+		std::vector<size_t> visited(1, i);
+		int target = push.target;
+		for (;;)
+		{
+			const size_t at = anchors[target];
+			if (at + 1 >= instrs.size() || instrs[at].op != Lexer::PUSH || instrs[at].target == -1 ||
+				instrs[at].operand != 0 || instrs[at].frozen || instrs[at + 1].op != Lexer::JMP || instrs[at + 1].frozen)
+				break;
+
+			bool cycle = false;
+			for (const size_t v : visited)
+				cycle |= v == at;
+			if (cycle)
+			{
+				target = push.target;
+				break;
+			}
+
+			visited.push_back(at);
+			target = instrs[at].target;
+		}
+
+		if (target != push.target)
+		{
+			push.target = target;
+			stats.cycles_saved += 2 * (visited.size() - 1);
+			changed = true;
+		}
+
+		// PUSH next; JMP
+		if (jump == Lexer::JMP && anchors[push.target] == i + 2 && !is_anchored(i + 1) && !instrs[i + 1].frozen)
+		{
+			removed[i] = removed[i + 1] = changed = true;
+			stats.cycles_saved += 2;
+			i++;
+		}
+	}
+
+	if (changed)
+		remove(removed);
+
+	return changed;
+}
+
+void Optimizer::remove(std::vector<bool> &removed)
+{
+	// An anchor on a removed instruction moves to the next one left
+	std::vector<size_t> new_index(instrs.size() + 1);
+	size_t kept = 0;
+	for (size_t i = 0; i < instrs.size(); i++)
+	{
+		new_index[i] = kept;
+		if (!removed[i])
+			instrs[kept++] = instrs[i];
+	}
+	new_index[instrs.size()] = kept;
+	instrs.resize(kept);
+
+	anchor_count.assign(instrs.size() + 1, 0);
+	for (size_t &anchor : anchors)
+		anchor_count[anchor = new_index[anchor]]++;
+}
+
+void Optimizer::encode(const bool compact)
+{
+	std::vector<size_t> size(instrs.size());
+	for (size_t i = 0; i < instrs.size(); i++)
+	{
+		size[i] = instrs[i].op == Lexer::PUSH ? 1 + sizeof(int32_t) : 1;
+		if (compact && is_plain_push(i) && fits(instrs[i].operand, 2))
+			size[i] = fits(instrs[i].operand, 1) ? 2 : 3;
+	}
+
+	// Instructions folded into the relative jump or call starting at an index
+	std::vector<size_t> folded(instrs.size(), 0);
+	for (size_t i = 0; compact && i < instrs.size(); i++)
+	{
+		folded[i] = is_relative_call(i) ? 3 : is_relative_jump(i) ? 1 : 0;
+		size[i] = folded[i] == 3 ? 3 : folded[i] == 1 ? 2 : size[i];
+		for (size_t j = 1; j <= folded[i]; j++)
+			size[i + j] = 0;
+		i += folded[i];
+	}
+
+	std::vector<size_t> address(instrs.size() + 1);
+	auto target_of = [&](const size_t i)
+	{
+		return address[anchors[instrs[i + folded[i] - 1].target]];
+	};
+
+	// Sizes only grow, so this stops
+	bool grown;
+	do
+	{
+		size_t addr = 0;
+		for (size_t i = 0; i < instrs.size(); i++)
+		{
+			address[i] = addr;
+			addr += size[i];
+		}
+		address[instrs.size()] = addr;
+
+		grown = false;
+		for (size_t i = 0; i < instrs.size(); i++)
+		{
+			if (folded[i] == 0)
+				continue;
+
+			const int64_t displacement = static_cast<int64_t>(target_of(i)) - (address[i] + size[i]);
+			if (fits(displacement, size[i] - 1))
+				continue;
+
+			grown = true;
+			if (size[i] == 2)
+				size[i] = 3;
+			else // Back to the original instructions
+			{
+				for (size_t j = 0; j <= folded[i]; j++)
+					size[i + j] = instrs[i + j].op == Lexer::PUSH ? 1 + sizeof(int32_t) : 1;
+				folded[i] = 0;
+			}
+		}
+	} while (grown);
+
+	std::vector<LabelTable::Label> &all = labels.all();
+	for (size_t i = 0; i < all.size(); i++)
+	{
+		all[i].address = address[anchors[i]];
+		all[i].usages.clear();
+	}
+
+	program.clear();
+	for (size_t i = 0; i < instrs.size(); i++)
+	{
+		const Instr &instr = instrs[i];
+
+		if (folded[i] != 0)
+		{
+			const uint8_t jump = instrs[i + folded[i]].op;
+			const bool is_short = size[i] == 2;
+			if (folded[i] == 3)
+				program.push_back(CALLREL16);
+			else if (jump == Lexer::JMP)
+				program.push_back(is_short ? JMPREL8 : JMPREL16);
+			else if (jump == Lexer::JZ)
+				program.push_back(is_short ? JZREL8 : JZREL16);
+			else
+				program.push_back(is_short ? JNZREL8 : JNZREL16);
+
+			const uint32_t displacement = target_of(i) - (address[i] + size[i]);
+			if (!is_short)
+				program.push_back(static_cast<uint8_t>(displacement >> 8));
+			program.push_back(static_cast<uint8_t>(displacement));
+
+			(is_short ? stats.short_jumps : stats.long_jumps)++;
+			stats.cycles_saved += folded[i];
+			i += folded[i];
+			continue;
+		}
+
+		if (instr.op == Lexer::PUSH && size[i] != 1 + sizeof(int32_t))
+		{
+			program.push_back(size[i] == 2 ? PUSH8 : PUSH16);
+			if (size[i] == 3)
+				program.push_back(static_cast<uint8_t>(instr.operand >> 8));
+			program.push_back(static_cast<uint8_t>(instr.operand));
+			continue;
+		}
+
+		program.push_back(instr.op);
+		if (instr.op != Lexer::PUSH)
+			continue;
+
+		if (instr.target != -1 && static_cast<size_t>(instr.target) < all.size())
+			all[instr.target].usages.push_back(program.size());
+
+		const uint32_t operand = instr.target != -1 ?
+			address[anchors[instr.target]] + instr.operand : instr.operand;
+		for (int shift = 24; shift >= 0; shift -= 8)
+			program.push_back(static_cast<uint8_t>(operand >> shift));
+	}
+
+	stats.bytes_after = program.size();
+}
+
+bool Optimizer::is_anchored(const size_t index) const
+{
+	return anchor_count[index] != 0;
+}
+
+bool Optimizer::is_plain_push(const size_t index) const
+{
+	return index < instrs.size() && instrs[index].op == Lexer::PUSH && instrs[index].target == -1 && !instrs[index].frozen;
+}
+
+bool Optimizer::is_relative_jump(const size_t index) const
+{
+	if (index + 1 >= instrs.size())
+		return false;
+
+	const Instr &push = instrs[index], &jump = instrs[index + 1];
+	return push.op == Lexer::PUSH && push.target != -1 && push.operand == 0 && !push.frozen &&
+		(jump.op == Lexer::JMP || jump.op == Lexer::JZ || jump.op == Lexer::JNZ) &&
+		!jump.frozen && !is_anchored(index + 1);
+}
+
+bool Optimizer::is_relative_call(const size_t index) const
+{
+	// CALLREL16 pushes the address after itself, so the return anchor has to be right after the JMP
+	if (index + 3 >= instrs.size() || !is_relative_jump(index + 2) || instrs[index + 3].op != Lexer::JMP)
+		return false;
+
+	const Instr &ret = instrs[index], &puship = instrs[index + 1];
+	return ret.op == Lexer::PUSH && ret.target != -1 && ret.operand == 0 && !ret.frozen &&
+		anchors[ret.target] == index + 4 && puship.op == Lexer::PUSHIP && !puship.frozen &&
+		!is_anchored(index + 1) && !is_anchored(index + 2);
+}
+
+bool Optimizer::uses_code_address(const uint8_t op)
+{
+	return op == Lexer::JMP || op == Lexer::JZ || op == Lexer::JNZ || op == Lexer::PUSHIP;
+}
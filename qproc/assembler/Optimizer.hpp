@@ -0,0 +1,78 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "LabelTable.hpp"
+
+struct OptimizerStats
+{
+	size_t bytes_before = 0, bytes_after = 0;
+	size_t cycles_saved = 0; // Reachable instructions removed, QProc executes one per cycle
+	size_t short_jumps = 0, long_jumps = 0; // Compact encoding: relative jumps and calls with 8 and 16 bit displacements
+	std::string skipped; // Why the program was left untouched, empty if it was optimized
+};
+
+/*
+ * Peephole passes over an assembled program, after the labels have been put
+ * in. Code positions are tracked as anchors: declared labels, plus integer
+ * operands directly used by JMP, JZ, JNZ or PUSHIP (CALL's return address).
+ * Anchored operands are rewritten when the code moves.
+ *
+ * A label whose address is used in any other way, e.g. by PUSHPM or POPPM,
+ * or with an offset, holds data: everything from it up to the next anchor is
+ * left exactly as is. Addresses built by arithmetic from anything but such a
+ * label are not supported.
+ *
+ * The compact encoding replaces "PUSH label; JMP / JZ / JNZ" and CALL's
+ * sequence with PC-relative instructions, and small PUSH operands with 8 or
+ * 16 bit ones. Every jump starts in its shortest form and only grows while
+ * its displacement does not fit, until the layout stops changing.
+ */
+class Optimizer
+{
+public:
+	Optimizer(std::vector<uint8_t> &program, LabelTable &labels);
+
+	OptimizerStats run(const bool peephole = true, const bool compact = false);
+
+private:
+	struct Instr
+	{
+		uint8_t op;
+		int32_t operand; // PUSH, the offset from the anchor when there is a target
+		int target; // Anchor the operand refers to, -1 - a plain integer
+		bool frozen;
+	};
+
+	bool decode();
+	void mark_frozen();
+
+	bool strip_nops();
+	bool fold_constants();
+	bool remove_dead_code();
+	bool thread_jumps();
+
+	void remove(std::vector<bool> &removed);
+	void encode(const bool compact);
+
+	bool is_anchored(const size_t index) const;
+	bool is_plain_push(const size_t index) const;
+	bool is_relative_jump(const size_t index) const; // PUSH label; JMP / JZ / JNZ
+	bool is_relative_call(const size_t index) const; // PUSH return; PUSHIP; PUSH label; JMP
+	static bool uses_code_address(const uint8_t op);
+
+	std::vector<uint8_t> &program;
+	LabelTable &labels;
+
+	std::vector<Instr> instrs;
+	std::vector<size_t> anchors; // Instruction index per anchor, the first labels.all().size() are labels
+	std::vector<size_t> anchor_count; // Anchors per instruction index, one extra for the end
+
+	OptimizerStats stats;
+};
+
+#endif
@@ -1,26 +1,106 @@
-#include "Assembler.hpp"
+#include "Build.hpp"
+#include "Linker.hpp"
 
+#include <cctype>
+#include <cerrno>
 #include <cstdlib>
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
-int main()
+/*
+ * Usage: assembler [-O] [--compact] [-j threads] [source... destination]
+ * The paths are asked for when not given. Several sources are linked into one
+ * ROM in the given order, and each gets an object file for incremental builds.
+ * --compact uses the extended encoding with short PC-relative jumps, which
+ * older emulators do not run.
+ */
+int main(int argc, char *argv[])
 {
 	std::cout << "Assembler for QProc" << std::endl <<
 		"Qwertygid, 2016" << std::endl << std::endl;
 
-	std::cout << "Enter source code's location: ";
-	std::string source_path;
-	std::cin >> source_path;
+	const std::string usage = std::string("Usage: ") + argv[0] +
+		" [-O] [--compact] [-j threads] [source... destination]";
+	const unsigned long MAX_THREADS = 1024;
 
-	std::cout << "Enter resulting ROM's location: ";
-	std::string dest_path;
-	std::cin >> dest_path;
+	bool optimize = false, compact = false;
+	unsigned threads = 0;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if (arg == "-O" || arg == "--optimize")
+			optimize = true;
+		else if (arg == "--compact")
+			compact = true;
+		else if (arg == "-j" || arg == "--threads")
+		{
+			// 0 - one per hardware thread; signs, blanks and trailing characters are rejected
+			const char *value = i + 1 < argc ? argv[++i] : "";
+			char *end = nullptr;
+			errno = 0;
+			const unsigned long n = std::strtoul(value, &end, 10);
+			if (!std::isdigit(static_cast<unsigned char>(*value)) || *end != '\0' || errno == ERANGE || n > MAX_THREADS)
+			{
+				std::cerr << "ERROR: Expected a number of threads up to " << MAX_THREADS << ", got '" <<
+					value << "'" << std::endl << usage << std::endl;
+				return EXIT_FAILURE;
+			}
+			threads = n;
+		}
+		else
+			paths.push_back(arg);
+	}
+
+	if (paths.empty())
+	{
+		paths.resize(2);
+
+		std::cout << "Enter source code's location: ";
+		std::cin >> paths[0];
+
+		std::cout << "Enter resulting ROM's location: ";
+		std::cin >> paths[1];
+	}
+	else if (paths.size() == 1)
+	{
+		std::cerr << usage << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const std::string dest_path = paths.back();
+	paths.pop_back();
 
 	try
 	{
-		Assembler assembler(source_path, dest_path);
-		assembler.assemble();
+		const bool incremental = paths.size() > 1;
+		Build build(paths, incremental, threads);
+		std::vector<Object> objects = build.run();
+
+		Linker linker(dest_path, optimize, compact);
+		for (size_t i = 0; i < paths.size(); i++)
+			linker.add(paths[i], std::move(objects[i]));
+		linker.link();
+
+		const BuildStats &build_stats = build.get_stats();
+		if (incremental)
+			std::cout << std::endl << "Assembled " << build_stats.assembled << ", up to date " <<
+				build_stats.up_to_date << ", threads " << build_stats.threads << std::endl;
+
+		const OptimizerStats &stats = linker.get_optimizer_stats();
+		if ((optimize || compact) && !stats.skipped.empty())
+			std::cout << std::endl << "Optimization skipped: " << stats.skipped << std::endl;
+		else if (optimize || compact)
+		{
+			std::cout << std::endl << "Optimized: " << stats.bytes_before << " -> " << stats.bytes_after <<
+				" bytes (" << stats.bytes_before - stats.bytes_after << " saved), about " <<
+				stats.cycles_saved << " cycles saved" << std::endl;
+			if (compact)
+				std::cout << "Relative jumps: " << stats.short_jumps << " short, " <<
+					stats.long_jumps << " long" << std::endl;
+		}
 	}
 	catch (const std::runtime_error &ex)
     {
@@ -2,31 +2,77 @@
 
 #include <climits>
 #include <iostream>
-#include <map>
 #include <stdexcept>
 
-Disassembler::Disassembler(std::string rom_path, std::string res_path) : ip(0)
+namespace
 {
-    std::ifstream rom_ifs(rom_path, std::ios::binary | std::ios::ate);
-    if (!rom_ifs.is_open())
-        error("Failed to open the ROM file", false);
+    enum OpFlags : uint8_t
+    {
+        FALLS_THROUGH = 1, // Execution may go on with the next instruction
+        ENDS_BLOCK = 2, // Jumps, returns and HALT
+        TAKES_ADDRESS = 4, // JMP, JZ, JNZ, PUSHIP: a PUSH right before holds a code address
+        RELATIVE = 8, // The operand is a displacement from the next instruction
+        COMPACT = 16 // Not in the assembly language, written as .byte
+    };
 
-    std::streampos filesize = rom_ifs.tellg();
+    struct OpInfo
+    {
+        const char *name; // nullptr - not an instruction
+        uint8_t length;
+        uint8_t flags;
+    };
 
-    if (filesize > sizeof(uint8_t) * MAX_ROM_SIZE)
-        error("Corrupt ROM", false);
+    const OpInfo OPS[256] =
+    {
+        { "NOP",       1, FALLS_THROUGH },
+        { "ADD",       1, FALLS_THROUGH },
+        { "SUB",       1, FALLS_THROUGH },
+        { "NEG",       1, FALLS_THROUGH },
+        { "SHL",       1, FALLS_THROUGH },
+        { "SHR",       1, FALLS_THROUGH },
+        { "AND",       1, FALLS_THROUGH },
+        { "OR",        1, FALLS_THROUGH },
+        { "XOR",       1, FALLS_THROUGH },
+        { "NOT",       1, FALLS_THROUGH },
+        { "JMP",       1, ENDS_BLOCK | TAKES_ADDRESS },
+        { "JZ",        1, FALLS_THROUGH | ENDS_BLOCK | TAKES_ADDRESS },
+        { "JNZ",       1, FALLS_THROUGH | ENDS_BLOCK | TAKES_ADDRESS },
+        { "PUSH",      5, FALLS_THROUGH },
+        { "RM",        1, FALLS_THROUGH },
+        { "PUSHIP",    1, FALLS_THROUGH | TAKES_ADDRESS },
+        { "POPIP",     1, ENDS_BLOCK },
+        { "RMIP",      1, FALLS_THROUGH },
+        { "PUSHPM",    1, FALLS_THROUGH },
+        { "POPPM",     1, FALLS_THROUGH },
+        { "INPUT",     1, FALLS_THROUGH },
+        { "PEEK",      1, FALLS_THROUGH },
+        { "HALT",      1, ENDS_BLOCK },
+        { "PUSH8",     2, FALLS_THROUGH | COMPACT },
+        { "PUSH16",    3, FALLS_THROUGH | COMPACT },
+        { "JMPREL8",   2, ENDS_BLOCK | RELATIVE | COMPACT },
+        { "JMPREL16",  3, ENDS_BLOCK | RELATIVE | COMPACT },
+        { "JZREL8",    2, FALLS_THROUGH | ENDS_BLOCK | RELATIVE | COMPACT },
+        { "JNZREL8",   2, FALLS_THROUGH | ENDS_BLOCK | RELATIVE | COMPACT },
+        { "JZREL16",   3, FALLS_THROUGH | ENDS_BLOCK | RELATIVE | COMPACT },
+        { "JNZREL16",  3, FALLS_THROUGH | ENDS_BLOCK | RELATIVE | COMPACT },
+        { "CALLREL16", 3, FALLS_THROUGH | ENDS_BLOCK | RELATIVE | COMPACT }
+    }; // The rest are zero-filled
 
-    rom_ifs.seekg(0);
+    const uint8_t JMP = 0x0A, PUSH = 0x0D, PUSHIP = 0x0F;
+    const size_t CALL_LENGTH = 12;
+    const size_t DATA_BYTES_PER_LINE = 8;
+}
 
-    size_t cell = 0;
-    while (rom_ifs.tellg() != filesize)
-        rom_ifs.read(reinterpret_cast<char*>(&ROM[cell++]), sizeof(uint8_t));
+Disassembler::Disassembler(std::string rom_path, std::string res_path) :
+    image(rom_path, MAX_ROM_SIZE), ROM(image.data()), rom_size(image.file_size())
+{
+    std::cout << "ROM loaded in " << image.load_time_ms() << " ms" << std::endl;
 
-    rom_ifs.close();
+    load_symbols(rom_path + ".sym");
 
     res_ofs.open(res_path);
     if (!res_ofs.is_open())
-        error("Failed to open the resulting file", false);
+        error("Failed to open the resulting file");
 }
 
 Disassembler::~Disassembler()
@@ -37,73 +83,241 @@ Disassembler::~Disassembler()
 
 void Disassembler::run()
 {
-    static const std::map<uint8_t, std::string> instrs =
-	{
-		{0x00,    "NOP"},
-		{0x01,    "ADD"},
-		{0x02,    "SUB"},
-		{0x03,    "NEG"},
-		{0x04,    "SHL"},
-		{0x05,    "SHR"},
-		{0x06,    "AND"},
-		{0x07,    "OR"},
-		{0x08,    "XOR"},
-		{0x09,    "NOT"},
-		{0x0A,    "JMP"},
-		{0x0B,    "JZ"},
-		{0x0C,    "JNZ"},
-		{0x0D,    "PUSH"},
-		{0x0E,    "RM"},
-		{0x0F,    "PUSHIP"},
-		{0x10,    "POPIP"},
-		{0x11,    "RMIP"},
-		{0x12,    "PUSHPM"},
-		{0x13,    "POPPM"},
-		{0x14,    "INPUT"},
-		{0x15,    "PEEK"},
-		{0x16,    "HALT"}
-};
-
-    for (; ip < MAX_ROM_SIZE; ip++)
+    trace();
+    write();
+}
+
+void Disassembler::load_symbols(const std::string filename)
+{
+    std::ifstream file(filename);
+
+    size_t address;
+    std::string label;
+    while (file >> address >> label)
+        symbols.emplace(address, label);
+}
+
+void Disassembler::trace()
+{
+    cells.assign(rom_size, UNKNOWN);
+    leaders.assign(rom_size + 1, 0);
+    targets.assign(rom_size + 1, 0);
+
+    add_target(0, false);
+    while (!worklist.empty())
     {
-        if (instrs.find(ROM[ip]) != instrs.end())
+        size_t ip = worklist.back();
+        worklist.pop_back();
+
+        while (ip < rom_size && cells[ip] == UNKNOWN)
         {
-            bool newline_needed = ip != MAX_ROM_SIZE - 1;
-
-            res_ofs << instrs.at(ROM[ip]);
-            if (instrs.at(ROM[ip]) == "PUSH")
-            {
-                if (ip + 1 > MAX_ROM_SIZE - sizeof(int32_t))
-                    error("PUSH used without a proper operand", true);
-
-                res_ofs << " " << construct_integer(ip + 1);
-                ip += 4;
-            }
-            else if (instrs.at(ROM[ip]) == "HALT")
+            const OpInfo &info = OPS[ROM[ip]];
+            if (info.name == nullptr || ip + info.length > rom_size)
+                break;
+
+            // Jumping into the middle of an instruction leaves the rest to it
+            bool overlaps = false;
+            for (size_t i = 1; i < info.length; i++)
+                overlaps |= cells[ip + i] != UNKNOWN;
+            if (overlaps)
                 break;
 
-            if (newline_needed)
-                res_ofs << std::endl;
+            cells[ip] = INSTR;
+            for (size_t i = 1; i < info.length; i++)
+                cells[ip + i] = OPERAND;
+
+            const size_t next = ip + info.length;
+            if (ROM[ip] == PUSH && next < rom_size && (OPS[ROM[next]].flags & TAKES_ADDRESS))
+                add_target(construct_integer(ip + 1), !is_call(ip)); // CALL's return address needs no label
+            if (info.flags & RELATIVE)
+                add_target(static_cast<int64_t>(next) + displacement(ip), true);
+
+            if (info.flags & ENDS_BLOCK)
+                leaders[next] = 1;
+            if (!(info.flags & FALLS_THROUGH))
+                break;
+
+            ip = next;
+        }
+    }
+}
+
+void Disassembler::add_target(const int64_t address, const bool needs_label)
+{
+    if (address < 0 || static_cast<size_t>(address) >= rom_size)
+        return;
+
+    leaders[address] = 1;
+    targets[address] |= needs_label;
+    if (cells[address] == UNKNOWN)
+        worklist.push_back(address);
+}
+
+void Disassembler::write()
+{
+    std::string out;
+    out.reserve(rom_size * 8);
+
+    auto symbol = symbols.begin();
+    size_t data_in_line = 0;
+    bool after_data = true;
+
+    for (size_t ip = 0; ip < rom_size;)
+    {
+        // Symbols inside an instruction's operand are dropped
+        while (symbol != symbols.end() && symbol->first < ip)
+            ++symbol;
+        const bool named = (symbol != symbols.end() && symbol->first == ip) || targets[ip];
+
+        if (data_in_line != 0 && (named || cells[ip] != UNKNOWN))
+        {
+            out += '\n';
+            data_in_line = 0;
+        }
+
+        if (cells[ip] == INSTR && (leaders[ip] || after_data))
+        {
+            if (!out.empty())
+                out += '\n';
+            blocks++;
+        }
+
+        if (named)
+        {
+            if (symbol == symbols.end() || symbol->first != ip)
+                out += "L_" + std::to_string(ip) + ":\n";
+            for (; symbol != symbols.end() && symbol->first == ip; ++symbol)
+                out += symbol->second + ":\n";
+        }
+
+        if (cells[ip] == INSTR)
+        {
+            after_data = false;
+            ip += write_instr(ip, out);
+            continue;
+        }
+
+        out += data_in_line == 0 ? "\t.byte " : " .byte ";
+        out += std::to_string(ROM[ip]);
+        if (++data_in_line == DATA_BYTES_PER_LINE)
+        {
+            out += '\n';
+            data_in_line = 0;
         }
+
+        after_data = true;
+        data_bytes++;
+        ip++;
+    }
+
+    if (data_in_line != 0)
+        out += '\n';
+    for (; symbol != symbols.end(); ++symbol) // Labels at the end of the program
+        if (symbol->first == rom_size)
+            out += symbol->second + ":\n";
+
+    res_ofs.write(out.data(), out.size());
+    if (!res_ofs)
+        error("Failed to write the resulting file");
+}
+
+size_t Disassembler::write_instr(const size_t ip, std::string &out)
+{
+    const uint8_t op = ROM[ip];
+    const OpInfo &info = OPS[op];
+
+    instrs++;
+    out += '\t';
+
+    if (op == PUSH && is_call(ip))
+    {
+        // The sequence only reads back as CALL when nothing jumps into it
+        const int32_t callee = construct_integer(ip + 7);
+        bool entered = false;
+        for (size_t i = 1; i < CALL_LENGTH; i++)
+            entered |= leaders[ip + i] || has_name(ip + i);
+
+        if (!entered && cells[ip + 5] == INSTR && cells[ip + 6] == INSTR && cells[ip + 11] == INSTR &&
+            callee >= 0 && static_cast<size_t>(callee) <= rom_size && has_name(callee))
+        {
+            out += "CALL " + name_of(callee) + '\n';
+            instrs += 3;
+            return CALL_LENGTH;
+        }
+    }
+
+    if (op == PUSH)
+    {
+        const int32_t value = construct_integer(ip + 1);
+        const size_t next = ip + info.length;
+
+        out += "PUSH ";
+        if (next < rom_size && (OPS[ROM[next]].flags & TAKES_ADDRESS) &&
+            value >= 0 && static_cast<size_t>(value) <= rom_size && has_name(value))
+            out += name_of(value);
+        else
+            out += std::to_string(value);
+        out += '\n';
+
+        return info.length;
+    }
+
+    if (info.flags & COMPACT)
+    {
+        for (size_t i = 0; i < info.length; i++)
+            out += (i == 0 ? ".byte " : " .byte ") + std::to_string(ROM[ip + i]);
+
+        out += " /*";
+        out += info.name;
+        out += ' ';
+        const int64_t target = static_cast<int64_t>(ip + info.length) + displacement(ip);
+        if (!(info.flags & RELATIVE))
+            out += std::to_string(displacement(ip));
+        else if (target >= 0 && static_cast<size_t>(target) <= rom_size && has_name(target))
+            out += name_of(target);
         else
-            error("Unknown operation", true);
+            out += std::to_string(target);
+        out += "*/\n";
+
+        return info.length;
     }
+
+    out += info.name;
+    out += '\n';
+
+    return info.length;
 }
 
-void Disassembler::error(std::string err_msg, bool print_ip) const
+bool Disassembler::is_call(const size_t ip) const
 {
-    std::string ex_text = "ERROR: " + err_msg;
+    return ip + CALL_LENGTH <= rom_size && ROM[ip] == PUSH && ROM[ip + 5] == PUSHIP &&
+        ROM[ip + 6] == PUSH && ROM[ip + 11] == JMP &&
+        construct_integer(ip + 1) == static_cast<int64_t>(ip + CALL_LENGTH);
+}
 
-    if (print_ip)
-        ex_text += "; Instruction #" + std::to_string(ip);
+bool Disassembler::has_name(const size_t address) const
+{
+    // A label can only be written down before an instruction or a data byte
+    if (address < rom_size && cells[address] == OPERAND)
+        return false;
+    return targets[address] || symbols.count(address) != 0;
+}
+
+std::string Disassembler::name_of(const size_t address) const
+{
+    const auto symbol = symbols.find(address);
+    return symbol != symbols.end() ? symbol->second : "L_" + std::to_string(address);
+}
 
-    throw std::runtime_error(ex_text);
+void Disassembler::error(std::string err_msg) const
+{
+    throw std::runtime_error("ERROR: " + err_msg);
 }
 
 int32_t Disassembler::construct_integer(size_t start_pos) const
 {
     if (start_pos > MAX_ROM_SIZE - sizeof(int32_t))
-        error("Not enough space for an integer", true);
+        error("Not enough space for an integer");
 
     int32_t integer = 0;
 
@@ -115,3 +329,10 @@ int32_t Disassembler::construct_integer(size_t start_pos) const
 
     return integer;
 }
+
+int32_t Disassembler::displacement(const size_t ip) const
+{
+    if (OPS[ROM[ip]].length == 2)
+        return static_cast<int8_t>(ROM[ip + 1]);
+    return static_cast<int16_t>(ROM[ip + 1] << 8 | ROM[ip + 2]);
+}
@@ -4,8 +4,19 @@
 #include <fstream>
 #include <cstdint>
 #include <cstdlib>
+#include <map>
 #include <string>
+#include <vector>
 
+#include "../../image/Image.hpp"
+
+/*
+ * Follows the code from address 0: PUSH x; JMP / JZ / JNZ / PUSHIP make x a
+ * code address, and so do the compact relative jumps. Bytes never reached
+ * are written as .byte data, so the output assembles back into the same ROM.
+ * Jump targets are labelled with the names from the ROM's .sym file when
+ * there is one, and with L_address otherwise.
+ */
 class Disassembler
 {
 public:
@@ -14,14 +25,39 @@ public:
 
     void run();
 
+    size_t get_instrs() const { return instrs; }
+    size_t get_blocks() const { return blocks; }
+    size_t get_data_bytes() const { return data_bytes; }
+
 private:
-    void error(std::string err_msg, bool print_ip) const;
+    enum Cell : uint8_t { UNKNOWN, INSTR, OPERAND };
+
+    void load_symbols(const std::string filename); // "address label" lines, a missing file is not an error
+    void trace();
+    void add_target(const int64_t address, const bool needs_label);
+    void write();
+    size_t write_instr(const size_t ip, std::string &out); // Returns the number of bytes written out
+
+    bool is_call(const size_t ip) const; // PUSH ip + 12; PUSHIP; PUSH x; JMP
+    bool has_name(const size_t address) const;
+    std::string name_of(const size_t address) const;
     int32_t construct_integer(size_t start_pos) const;
+    int32_t displacement(const size_t ip) const; // Of a compact relative jump
+
+    void error(std::string err_msg) const;
 
     static const size_t MAX_ROM_SIZE = 204800;
-    uint8_t ROM[MAX_ROM_SIZE] = {0};
+    Image image;
+    const uint8_t *ROM;
+    size_t rom_size; // The zero fill after the file is not disassembled
+
+    std::vector<uint8_t> cells; // Cell per ROM byte
+    std::vector<uint8_t> leaders; // 1 - a basic block starts there, one extra for the end
+    std::vector<uint8_t> targets; // 1 - referred to by a label
+    std::vector<size_t> worklist;
+    std::multimap<size_t, std::string> symbols;
 
-    size_t ip;
+    size_t instrs = 0, blocks = 0, data_bytes = 0;
 
     std::ofstream res_ofs;
 };
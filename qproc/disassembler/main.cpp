@@ -1,29 +1,52 @@
+#include <chrono>
 #include <iostream>
 #include <cstdlib>
 #include <stdexcept>
 
 #include "Disassembler.hpp"
 
-int main()
+/*
+ * Usage: disassembler [ROM result]
+ * The paths are asked for when not given.
+ */
+int main(int argc, char *argv[])
 {
     std::cout << std::endl << "QProc disassembler" <<
         std::endl << "Qwertygid, 2016" << std::endl << std::endl;
 
-    std::cout << "Enter ROM's location: ";
-
-    std::string rom_path;
-    std::cin >> rom_path;
+    std::string rom_path, result_path;
+    if (argc == 3)
+    {
+        rom_path = argv[1];
+        result_path = argv[2];
+    }
+    else if (argc == 1)
+    {
+        std::cout << "Enter ROM's location: ";
+        std::cin >> rom_path;
 
-    std::cout << "Enter resulting file's location: ";
-    std::string result_path;
-    std::cin >> result_path;
+        std::cout << "Enter resulting file's location: ";
+        std::cin >> result_path;
 
-    std::cout << std::endl;
+        std::cout << std::endl;
+    }
+    else
+    {
+        std::cerr << "Usage: " << argv[0] << " [ROM result]" << std::endl;
+        return EXIT_FAILURE;
+    }
 
     try
     {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
         Disassembler disassembler(rom_path, result_path);
         disassembler.run();
+
+        const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << disassembler.get_instrs() << " instructions in " << disassembler.get_blocks() <<
+            " basic blocks, " << disassembler.get_data_bytes() << " data bytes, " << elapsed.count() <<
+            " ms" << std::endl;
     }
     catch (const std::runtime_error &ex)
     {
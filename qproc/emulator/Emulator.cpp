@@ -1,30 +1,69 @@
 #include "Emulator.hpp"
 
+#include "IOChannel.hpp"
+#include "Jit.hpp"
+#include "Profiler.hpp"
+#include "Snapshot.hpp"
+
+#include <algorithm>
 #include <climits>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 
-Emulator::Emulator(const std::string filename) :
-	halt_called(false)
+#if defined(__GNUC__)
+#define QPROC_COMPUTED_GOTO // Labels as values are a GNU extension
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define QPROC_FORK_SUPPORTED // Snapshots are written by a copy-on-write child process
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+Emulator::Emulator(const std::string filename, const EmulatorSettings settings) :
+	Emulator(settings)
+{
+	load(filename);
+}
+
+Emulator::Emulator(const EmulatorSettings settings) :
+	PM(nullptr),
+	IS_mem(settings.IS_max_depth), IS(IS_mem.data()), IS_size(0),
+	DS_mem(settings.DS_max_depth + 1), DS(DS_mem.data() + 1), DS_size(0),
+	halt_called(false), frame_buffer(VIDEOMEM_SIZE),
+	dirty_row_first(0), dirty_row_last(WINDOW_H - 1), settings(settings),
+	io(settings.io ? settings.io : std::make_shared<StreamIOChannel>(std::cin, std::cout)),
+	dump_path(settings.dump_path), profile_path(settings.profile_path),
+	snapshot_path(settings.snapshot_path)
 {
-    std::ifstream file;
-    file.open(filename, std::ios::binary | std::ios::ate);
-    if (!file.is_open())
-        error("Could not open the ROM", false);
+	if (settings.instrs_per_frame == 0)
+		error("Instructions per frame should be greater than 0", false);
+	if (settings.frame_rate < 0)
+		error("Frame rate should not be negative", false);
+	if (settings.DS_max_depth == 0 || settings.IS_max_depth == 0)
+		error("Stack depths should be greater than 0", false);
+	if (settings.snapshot_every != 0 && settings.snapshot_path.empty())
+		error("Periodic snapshots need a snapshot path", false);
 
-    std::streampos fsize = file.tellg();
-    std::cout << "Filesize: " << fsize << " bytes" << std::endl << std::endl;
-    if (fsize > PM_SIZE * sizeof(uint8_t))
-        error("Corrupt ROM", false);
+	if (!settings.profile_path.empty())
+		profiler.reset(new Profiler(PM_SIZE));
 
-    file.seekg(0);
+	if (settings.engine == EmulatorEngine::Predecoded)
+		decoded.resize(PM_SIZE + 1);
+	else if (settings.engine == EmulatorEngine::Jit)
+	{
+		if (Jit::is_supported())
+			jit.reset(new Jit(PM, PM_SIZE, VIDEOMEM_BEG, settings.DS_max_depth, settings.IS_max_depth));
+		else if (!settings.quiet)
+			std::cout << "JIT is not supported on this host, using the interpreter" <<
+				std::endl << std::endl;
+	}
 
-    size_t PM_Cell = 0;
-    while (file.tellg() != fsize)
-        file.read(reinterpret_cast<char*>(&PM[PM_Cell++]), sizeof(uint8_t));
+	init_palette();
 
-    file.close();
+	if (settings.headless)
+		return;
 
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 		error("Failed to initialize SDL", false);
@@ -38,52 +77,271 @@ Emulator::Emulator(const std::string filename) :
 	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
 	if (renderer == nullptr)
 		error("Failed to create a renderer", false);
+
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+								WINDOW_W, WINDOW_H);
+	if (texture == nullptr)
+		error("Failed to create a video memory texture", false);
 }
 
 Emulator::~Emulator()
 {
+	io->flush(); // Output produced before an error
+
+	try
+	{
+		wait_for_snapshot();
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+
+	if (texture != nullptr)
+		SDL_DestroyTexture(texture);
+
 	if (renderer != nullptr)
 		SDL_DestroyRenderer(renderer);
 
 	if (window != nullptr)
 		SDL_DestroyWindow(window);
 
-	SDL_Quit();
+	if (!settings.headless)
+		SDL_Quit();
 }
 
-void Emulator::run()
+void Emulator::load(const std::string filename)
 {
-	SDL_Event e;
+	io->flush(); // Output of the previous program
+	wait_for_snapshot();
+
+	image.reset(); // Unmap the previous ROM first
+	PM = nullptr;
+	rom_path = filename;
+
+	image.reset(new Image(filename, PM_SIZE + 1));
+	PM = image->data();
 
-	for (IP = 0; !halt_called && IP < PM_SIZE; IP++)
+	if (!settings.quiet)
+		std::cout << "Filesize: " << image->file_size() << " bytes, loaded in " <<
+			image->load_time_ms() << " ms" << std::endl << std::endl;
+	if (image->file_size() > PM_SIZE) // The extra cell is reserved for PM_GUARD
+		error("Corrupt ROM", false);
+
+	PM[PM_SIZE] = PM_GUARD;
+
+	if (profiler)
 	{
-		SDL_PollEvent(&e);
+		profiler->reset();
+		profiler->load_symbols(filename + ".sym"); // Written by the Assembler next to the ROM
+	}
 
-		draw_video_mem();
-		do_instruction();
+	if (settings.engine == EmulatorEngine::Predecoded)
+		decode(0, PM_SIZE + 1);
+	else if (jit)
+		jit->reset(PM);
+
+	IP = 0;
+	IS_size = 0;
+	DS_size = 0;
+	halt_called = false;
+	instrs_executed = 0;
+
+	dirty_row_first = 0;
+	dirty_row_last = WINDOW_H - 1;
+	frames_num = 0;
+}
+
+void Emulator::set_io(std::shared_ptr<IOChannel> io)
+{
+	if (!io)
+		error("I/O channel should not be null", false);
+
+	this->io->flush();
+	this->io = io;
+}
+
+void Emulator::set_dump_path(const std::string dump_path)
+{
+	this->dump_path = dump_path;
+}
+
+void Emulator::set_profile_path(const std::string profile_path)
+{
+	this->profile_path = profile_path;
+}
+
+void Emulator::set_snapshot_path(const std::string snapshot_path)
+{
+	this->snapshot_path = snapshot_path;
+}
+
+void Emulator::save_snapshot(const std::string filename)
+{
+	if (PM == nullptr)
+		error("No ROM is loaded", false);
+
+	SnapshotState state;
+	state.IP = IP;
+	state.halt_called = halt_called;
+	state.instrs_executed = instrs_executed;
+	state.DS.assign(DS, DS + DS_size);
+	state.IS.assign(IS, IS + IS_size);
+
+	const Image rom(rom_path, PM_SIZE + 1); // A fresh mapping of the unmodified ROM
+	Snapshot::save(filename, state, PM, rom.data(), PM_SIZE);
+}
+
+void Emulator::restore_snapshot(const std::string filename)
+{
+	if (PM == nullptr)
+		error("No ROM is loaded", false);
+
+	const Image rom(rom_path, PM_SIZE + 1);
+	const SnapshotState state = Snapshot::restore(filename, PM, rom.data(), PM_SIZE,
+		settings.DS_max_depth, settings.IS_max_depth);
+
+	IP = state.IP;
+	halt_called = state.halt_called;
+	instrs_executed = state.instrs_executed;
+	std::copy(state.DS.begin(), state.DS.end(), DS);
+	DS_size = state.DS.size();
+	std::copy(state.IS.begin(), state.IS.end(), IS);
+	IS_size = state.IS.size();
+
+	// PM has changed under the engine caches
+	if (settings.engine == EmulatorEngine::Predecoded)
+		decode(0, PM_SIZE + 1);
+	else if (jit)
+		jit->reset(PM);
+
+	dirty_row_first = 0;
+	dirty_row_last = WINDOW_H - 1;
+}
+
+void Emulator::capture_snapshot()
+{
+#ifdef QPROC_FORK_SUPPORTED
+	if (settings.snapshot_async)
+	{
+		wait_for_snapshot(); // At most one writer at a time
+		io->flush(); // Or the child would inherit the pending output
+
+		// The child sees the machine as it is now, the parent goes on running
+		const pid_t pid = fork();
+		if (pid == 0)
+		{
+			try
+			{
+				save_snapshot(snapshot_path);
+			}
+			catch (...)
+			{
+				_exit(EXIT_FAILURE);
+			}
+			_exit(EXIT_SUCCESS);
+		}
+		if (pid > 0)
+		{
+			snapshot_writer = pid;
+			return;
+		}
+		// fork() failed, write the snapshot right here
 	}
+#endif
+	save_snapshot(snapshot_path);
 }
 
-size_t Emulator::pop_IS()
+void Emulator::wait_for_snapshot()
 {
-    if (IS.empty())
-        error("Attempted to pop empty IS", true);
+#ifdef QPROC_FORK_SUPPORTED
+	if (snapshot_writer == 0)
+		return;
 
-    size_t top = IS.top();
-    IS.pop();
+	int status;
+	const pid_t pid = waitpid(snapshot_writer, &status, 0);
+	snapshot_writer = 0;
 
-    return top;
+	if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		error("Failed to write a snapshot", false);
+#endif
 }
 
-int32_t Emulator::pop_DS()
+void Emulator::run()
 {
-    if (DS.empty())
-        error("Attempted to pop empty DS", true);
+	if (PM == nullptr) // Before the first frame, which reads video memory out of PM
+		error("No ROM is loaded", false);
+
+	if (settings.frame_rate > 0)
+		frame_interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(1.0 / settings.frame_rate));
+	else
+		frame_interval = std::chrono::steady_clock::duration::zero();
+
+	last_frame_time = std::chrono::steady_clock::now();
+	handle_frame(true);
+
+	run_start = std::chrono::steady_clock::now();
+	const auto deadline = run_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(settings.max_seconds));
+	next_snapshot = instrs_executed + settings.snapshot_every;
+
+	while (!halt_called && IP < PM_SIZE)
+	{
+		size_t slice = settings.instrs_per_frame;
+		if (settings.max_instrs != 0)
+		{
+			if (instrs_executed >= settings.max_instrs)
+				limit_error(EmulatorLimitError::InstructionBudget, "Instruction limit exceeded");
+			slice = std::min<uint64_t>(slice, settings.max_instrs - instrs_executed);
+		}
+		if (settings.max_seconds > 0 && std::chrono::steady_clock::now() >= deadline)
+			limit_error(EmulatorLimitError::Watchdog, "Time limit exceeded");
+		if (settings.snapshot_every != 0)
+			slice = std::min<uint64_t>(slice, next_snapshot - instrs_executed);
+
+		instrs_executed += execute(slice);
 
-    int32_t top = DS.top();
-    DS.pop();
+		if (settings.snapshot_every != 0 && instrs_executed >= next_snapshot)
+		{
+			capture_snapshot();
+			next_snapshot = instrs_executed + settings.snapshot_every;
+		}
 
-    return top;
+		handle_frame(false);
+	}
+
+	io->flush();
+	wait_for_snapshot();
+
+	handle_frame(true); // Show the final state of the video memory
+
+	if (!dump_path.empty())
+		dump_video_mem(dump_path + "_halt.ppm");
+
+	if (profiler)
+		profiler->write_report(profile_path, PM);
+}
+
+void Emulator::handle_frame(const bool force)
+{
+	SDL_Event e;
+	if (!settings.headless)
+		while (SDL_PollEvent(&e))
+			;
+
+	const auto now = std::chrono::steady_clock::now();
+	if (!force && now - last_frame_time < frame_interval)
+		return;
+
+	last_frame_time = now;
+	frames_num++;
+
+	if (!settings.headless)
+		draw_video_mem();
+
+	if (!dump_path.empty() && settings.dump_every_frames != 0 &&
+		frames_num % settings.dump_every_frames == 0)
+		dump_video_mem(dump_path + "_" + std::to_string(frames_num) + ".ppm");
 }
 
 int32_t Emulator::get_data_from_PM(const size_t beginning)
@@ -102,204 +360,1205 @@ int32_t Emulator::get_data_from_PM(const size_t beginning)
     return result;
 }
 
+int32_t Emulator::get_short_operand(const size_t ip)
+{
+	const size_t length = compact_length(PM[ip]);
+	if (is_not_in_bounds(ip, PM_SIZE - length))
+		error_at("Compact instruction used without a proper operand", ip);
+
+	if (length == 2)
+		return static_cast<int8_t>(PM[ip + 1]);
+	return static_cast<int16_t>(PM[ip + 1] << 8 | PM[ip + 2]);
+}
+
+int32_t Emulator::get_relative_target(const size_t ip)
+{
+	const int32_t target = static_cast<int32_t>(ip + compact_length(PM[ip])) + get_short_operand(ip);
+	if (is_not_in_bounds(target))
+		error_at("Target is out of bounds in a relative jump", ip);
+
+	return target;
+}
+
 bool Emulator::is_not_in_bounds(const int32_t value, const size_t right_bound)
 {
     return (value > right_bound) || (value < 0);
 }
 
-void Emulator::do_instruction()
-{
-	enum opcodes
-	{
-		NOP = 0x00,
-		ADD = 0x01,
-		SUB = 0x02,
-		NEG = 0x03,
-		SHL = 0x04,
-		SHR = 0x05,
-		AND = 0x06,
-		OR = 0x07,
-		XOR = 0x08,
-		NOT = 0x09,
-		JMP = 0x0A,
-		JZ = 0x0B,
-		JNZ = 0x0C,
-		PUSH = 0x0D,
-		RM = 0x0E,
-		PUSHIP = 0x0F,
-		POPIP = 0x10,
-		RMIP = 0x11,
-		PUSHPM = 0x12,
-		POPPM = 0x13,
-		INPUT = 0x14,
-		PEEK = 0x15,
-		HALT = 0x16
-	};
-
-	switch (PM[IP])
-	{
-	case NOP:
-		break;
-	case ADD:
-		DS.push(pop_DS() + pop_DS());
-		break;
-	case SUB:
-	{
-		const int32_t Y = pop_DS(), X = pop_DS();
-		DS.push(X - Y);
-	}
-		break;
-	case NEG:
-		DS.push(-pop_DS());
-		break;
-	case SHL:
-	{
-		const int32_t Y = pop_DS(), X = pop_DS();
-		DS.push(X << Y);
-	}
-		break;
-	case SHR:
-	{
-		const int32_t Y = pop_DS(), X = pop_DS();
-		DS.push(X >> Y);
-	}
-		break;
-	case AND:
-		DS.push(pop_DS() & pop_DS());
-		break;
-	case OR:
-		DS.push(pop_DS() | pop_DS());
-		break;
-	case XOR:
-		DS.push(pop_DS() ^ pop_DS());
-		break;
-	case NOT:
-		DS.push(~pop_DS());
-		break;
-	case JMP:
-	{
-		const int32_t X = pop_DS();
-		if (is_not_in_bounds(X))
-			error("X is out of bounds in JMP", true);
+bool Emulator::is_self_loop(const size_t push_ip)
+{
+	// Nothing in such a loop can change what it does, so it never ends
+	const size_t JMP_OFFSET = 1 + sizeof(int32_t);
+	return push_ip + JMP_OFFSET < PM_SIZE && PM[push_ip] == PUSH && PM[push_ip + JMP_OFFSET] == JMP &&
+		get_data_from_PM(push_ip + 1) == static_cast<int32_t>(push_ip);
+}
+
+size_t Emulator::execute(const size_t instrs_num)
+{
+	if (profiler)
+		return execute_switch<true>(instrs_num);
+
+	switch (settings.engine)
+	{
+	case EmulatorEngine::Switch:
+		return execute_switch<false>(instrs_num);
+	case EmulatorEngine::Threaded:
+		return execute_threaded(instrs_num);
+	case EmulatorEngine::Predecoded:
+		return execute_predecoded(instrs_num);
+	case EmulatorEngine::Jit:
+		if (jit)
+			return execute_jit(instrs_num);
+		return execute_threaded(instrs_num);
+	}
+
+	return 0;
+}
+
+template <bool Profiled>
+size_t Emulator::execute_switch(const size_t instrs_num)
+{
+	/*
+	 * DS[0 .. ds_size - 2] live in memory, DS top is cached in tos.
+	 * DS[-1] is a sentinel cell, so that popping the last element
+	 * can refill tos without an extra check.
+	 */
+	size_t ip = IP;
+	int32_t *ds = DS;
+	size_t ds_size = DS_size;
+	int32_t tos = ds[static_cast<ptrdiff_t>(ds_size) - 1];
+	const size_t ds_max = settings.DS_max_depth;
+
+	size_t i = 0;
+	for (; i < instrs_num && !halt_called && ip < PM_SIZE; i++, ip++)
+	{
+		if (Profiled)
+			profiler->step(ip, PM[ip], ds_size, IS_size);
+
+		switch (PM[ip])
+		{
+		case NOP:
+			break;
+		case ADD:
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ds[ds_size-- - 2] + tos;
+			break;
+		case SUB:
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ds[ds_size-- - 2] - tos;
+			break;
+		case NEG:
+			if (ds_size < 1)
+				error_at("Attempted to pop empty DS", ip);
+			tos = -tos;
+			break;
+		case SHL:
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ds[ds_size-- - 2] << tos;
+			break;
+		case SHR:
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ds[ds_size-- - 2] >> tos;
+			break;
+		case AND:
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ds[ds_size-- - 2] & tos;
+			break;
+		case OR:
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ds[ds_size-- - 2] | tos;
+			break;
+		case XOR:
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ds[ds_size-- - 2] ^ tos;
+			break;
+		case NOT:
+			if (ds_size < 1)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ~tos;
+			break;
+		case JMP:
+		{
+			if (ds_size < 1)
+				error_at("Attempted to pop empty DS", ip);
+			const int32_t X = tos;
+			tos = ds[static_cast<ptrdiff_t>(--ds_size) - 1];
+			if (is_not_in_bounds(X))
+				error_at("X is out of bounds in JMP", ip);
+			if (static_cast<size_t>(X) + 1 + sizeof(int32_t) == ip && is_self_loop(X))
+			{
+				ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+				DS_size = ds_size;
+				IP = X;
+				limit_error(EmulatorLimitError::InfiniteLoop, "Infinite loop");
+			}
 
-		IP = X - 1; //IP will get incremented in a loop afterwards
+			ip = X - 1; //IP will get incremented in a loop afterwards
+		}
+			break;
+		case JZ:
+		{
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			const int32_t Y = tos, X = ds[ds_size - 2];
+			ds_size -= 2;
+			tos = ds[static_cast<ptrdiff_t>(ds_size) - 1];
+			if (is_not_in_bounds(Y))
+				error_at("Y is out of bounds in JZ", ip);
+			if (X == 0)
+				ip = Y - 1; //IP will get incremented in a loop afterwards
+		}
+			break;
+		case JNZ:
+		{
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			const int32_t Y = tos, X = ds[ds_size - 2];
+			ds_size -= 2;
+			tos = ds[static_cast<ptrdiff_t>(ds_size) - 1];
+			if (is_not_in_bounds(Y))
+				error_at("Y is out of bounds in JZ", ip);
+			if (X != 0)
+				ip = Y - 1; //IP will get incremented in a loop afterwards
+		}
+			break;
+		case PUSH:
+			if (is_not_in_bounds(ip, PM_SIZE - sizeof(int32_t) - 1))
+				error_at("PUSH used without a proper operand", ip);
+			if (ds_size == ds_max)
+				error_at("DS overflow", ip);
+			ds[static_cast<ptrdiff_t>(ds_size++) - 1] = tos;
+			tos = get_data_from_PM(ip + 1);
+			ip += sizeof(int32_t); // IP will get incremented in a loop afterwards
+			break;
+		case RM:
+			if (ds_size < 1)
+				error_at("Attempted to pop empty DS", ip);
+			tos = ds[static_cast<ptrdiff_t>(--ds_size) - 1];
+			break;
+		case PUSHIP:
+		{
+			if (ds_size < 1)
+				error_at("Attempted to pop empty DS", ip);
+			const int32_t X = tos;
+			tos = ds[static_cast<ptrdiff_t>(--ds_size) - 1];
+			if (is_not_in_bounds(X))
+				error_at("X is out of bounds in PUSHIP", ip);
+			if (IS_size == settings.IS_max_depth)
+				error_at("IS overflow", ip);
+			IS[IS_size++] = X;
+		}
+			break;
+		case POPIP:
+			if (IS_size == 0)
+				error_at("Attempted to pop empty IS", ip);
+			ip = IS[--IS_size];
+			if (is_not_in_bounds(ip))
+				error_at("IP is out of bounds in POPIP", ip);
+			ip--; // IP will get incremented in a loop afterwards
+			break;
+		case RMIP:
+			if (IS_size == 0)
+				error_at("Attempted to pop empty IS", ip);
+			IS_size--;
+			break;
+		case PUSHPM:
+			if (ds_size < 1)
+				error_at("Attempted to pop empty DS", ip);
+			if (is_not_in_bounds(tos, PM_SIZE - sizeof(int32_t)))
+				error_at("X is out of bounds in PUSHPM", ip);
+			tos = get_data_from_PM(tos);
+			break;
+		case POPPM:
+		{
+			if (ds_size < 2)
+				error_at("Attempted to pop empty DS", ip);
+			int32_t Y = tos;
+			int32_t X = ds[ds_size - 2];
+			ds_size -= 2;
+			tos = ds[static_cast<ptrdiff_t>(ds_size) - 1];
+			if (is_not_in_bounds(X, PM_SIZE - sizeof(int32_t)))
+				error_at("X is out of bounds in POPPM", ip);
+			if (X + sizeof(int32_t) > VIDEOMEM_BEG)
+				mark_video_mem_dirty(X, sizeof(int32_t));
+			for (size_t j = 0; j < sizeof(int32_t); j++)
+				PM[X++] = reinterpret_cast<int8_t*>(&Y)[sizeof(int32_t) - 1 - j];
+		}
+			break;
+		case INPUT:
+		{
+			if (ds_size == ds_max)
+				error_at("DS overflow", ip);
+			int32_t input;
+			if (!io->read(input))
+				error_at("Invalid input", ip);
+			ds[static_cast<ptrdiff_t>(ds_size++) - 1] = tos;
+			tos = input;
+		}
+			break;
+		case PEEK:
+			if (ds_size < 1)
+				error_at("Tried to PEEK empty DS", ip);
+			io->write(tos);
+			break;
+		case HALT:
+			halt_called = true;
+			break;
+		case PUSH8:
+		case PUSH16:
+		{
+			const int32_t X = get_short_operand(ip);
+			if (ds_size == ds_max)
+				error_at("DS overflow", ip);
+			ds[static_cast<ptrdiff_t>(ds_size++) - 1] = tos;
+			tos = X;
+			ip += compact_length(PM[ip]) - 1; // IP will get incremented in a loop afterwards
+		}
+			break;
+		case JMPREL8:
+		case JMPREL16:
+		{
+			const int32_t X = get_relative_target(ip);
+			if (static_cast<size_t>(X) == ip)
+			{
+				ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+				DS_size = ds_size;
+				IP = ip;
+				limit_error(EmulatorLimitError::InfiniteLoop, "Infinite loop");
+			}
+			ip = X - 1; //IP will get incremented in a loop afterwards
+		}
+			break;
+		case JZREL8:
+		case JZREL16:
+		case JNZREL8:
+		case JNZREL16:
+		{
+			if (ds_size < 1)
+				error_at("Attempted to pop empty DS", ip);
+			const int32_t X = tos, Y = get_relative_target(ip);
+			tos = ds[static_cast<ptrdiff_t>(--ds_size) - 1];
+			if ((X == 0) == (PM[ip] == JZREL8 || PM[ip] == JZREL16))
+				ip = Y - 1; //IP will get incremented in a loop afterwards
+			else
+				ip += compact_length(PM[ip]) - 1;
+		}
+			break;
+		case CALLREL16:
+		{
+			const int32_t X = get_relative_target(ip);
+			if (IS_size == settings.IS_max_depth)
+				error_at("IS overflow", ip);
+			IS[IS_size++] = ip + compact_length(CALLREL16);
+			ip = X - 1; //IP will get incremented in a loop afterwards
+		}
+			break;
+		default:
+			error_at("Unknown instruction", ip);
+		}
 	}
-		break;
-	case JZ:
+
+	ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+	DS_size = ds_size;
+	IP = ip;
+
+	return i;
+}
+
+/*
+ * Same semantics as execute_switch(), but every handler jumps straight to the
+ * next one. The slice length is only checked on control transfers, so a
+ * slice may run a little longer than instrs_num on straight-line code;
+ * running off the end of PM hits PM_GUARD instead of an explicit IP check.
+ */
+size_t Emulator::execute_threaded(const size_t instrs_num)
+{
+#ifdef QPROC_COMPUTED_GOTO
+#define OP(name) op_##name
+#define OP_DEFAULT op_unknown
+#define DISPATCH() goto *dispatch[PM[ip]]
+#else
+#define OP(name) case name
+#define OP_DEFAULT default
+#define DISPATCH() goto dispatch_top
+#endif
+
+#define NEXT(len) do { ip += (len); remaining--; DISPATCH(); } while (0)
+#define BRANCH() do { if (--remaining <= 0) goto slice_end; DISPATCH(); } while (0)
+#define NEED_DS(n) do { if (ds_size < (n)) error_at("Attempted to pop empty DS", ip); } while (0)
+#define DROP_DS(n) do { ds_size -= (n); tos = ds[static_cast<ptrdiff_t>(ds_size) - 1]; } while (0)
+#define PUSH_DS(value) do { ds[static_cast<ptrdiff_t>(ds_size++) - 1] = tos; tos = (value); } while (0)
+
+	size_t ip = IP;
+	int32_t *ds = DS;
+	size_t ds_size = DS_size;
+	int32_t tos = ds[static_cast<ptrdiff_t>(ds_size) - 1];
+	const size_t ds_max = settings.DS_max_depth;
+	ptrdiff_t remaining = instrs_num;
+
+#ifdef QPROC_COMPUTED_GOTO
+	void *dispatch[256];
+	for (auto &label : dispatch)
+		label = &&op_unknown;
+
+	dispatch[NOP] = &&op_NOP;
+	dispatch[ADD] = &&op_ADD;
+	dispatch[SUB] = &&op_SUB;
+	dispatch[NEG] = &&op_NEG;
+	dispatch[SHL] = &&op_SHL;
+	dispatch[SHR] = &&op_SHR;
+	dispatch[AND] = &&op_AND;
+	dispatch[OR] = &&op_OR;
+	dispatch[XOR] = &&op_XOR;
+	dispatch[NOT] = &&op_NOT;
+	dispatch[JMP] = &&op_JMP;
+	dispatch[JZ] = &&op_JZ;
+	dispatch[JNZ] = &&op_JNZ;
+	dispatch[PUSH] = &&op_PUSH;
+	dispatch[RM] = &&op_RM;
+	dispatch[PUSHIP] = &&op_PUSHIP;
+	dispatch[POPIP] = &&op_POPIP;
+	dispatch[RMIP] = &&op_RMIP;
+	dispatch[PUSHPM] = &&op_PUSHPM;
+	dispatch[POPPM] = &&op_POPPM;
+	dispatch[INPUT] = &&op_INPUT;
+	dispatch[PEEK] = &&op_PEEK;
+	dispatch[HALT] = &&op_HALT;
+	dispatch[PUSH8] = &&op_PUSH8;
+	dispatch[PUSH16] = &&op_PUSH16;
+	dispatch[JMPREL8] = &&op_JMPREL8;
+	dispatch[JMPREL16] = &&op_JMPREL16;
+	dispatch[JZREL8] = &&op_JZREL8;
+	dispatch[JNZREL8] = &&op_JNZREL8;
+	dispatch[JZREL16] = &&op_JZREL16;
+	dispatch[JNZREL16] = &&op_JNZREL16;
+	dispatch[CALLREL16] = &&op_CALLREL16;
+
+	if (halt_called)
+		goto slice_end;
+	DISPATCH();
 	{
-		const int32_t Y = pop_DS(), X = pop_DS();
+#else
+	if (halt_called)
+		goto slice_end;
+dispatch_top:
+	switch (PM[ip])
+	{
+#endif
+	OP(NOP):
+		NEXT(1);
+	OP(ADD):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] + tos;
+		NEXT(1);
+	OP(SUB):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] - tos;
+		NEXT(1);
+	OP(NEG):
+		NEED_DS(1);
+		tos = -tos;
+		NEXT(1);
+	OP(SHL):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] << tos;
+		NEXT(1);
+	OP(SHR):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] >> tos;
+		NEXT(1);
+	OP(AND):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] & tos;
+		NEXT(1);
+	OP(OR):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] | tos;
+		NEXT(1);
+	OP(XOR):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] ^ tos;
+		NEXT(1);
+	OP(NOT):
+		NEED_DS(1);
+		tos = ~tos;
+		NEXT(1);
+	OP(JMP):
+	{
+		NEED_DS(1);
+		const int32_t X = tos;
+		DROP_DS(1);
+		if (is_not_in_bounds(X))
+			error_at("X is out of bounds in JMP", ip);
+		if (static_cast<size_t>(X) + 1 + sizeof(int32_t) == ip && is_self_loop(X))
+		{
+			ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+			DS_size = ds_size;
+			IP = X;
+			limit_error(EmulatorLimitError::InfiniteLoop, "Infinite loop");
+		}
+		ip = X;
+	}
+		BRANCH();
+	OP(JZ):
+	{
+		NEED_DS(2);
+		const int32_t Y = tos, X = ds[ds_size - 2];
+		DROP_DS(2);
 		if (is_not_in_bounds(Y))
-			error("Y is out of bounds in JZ", true);
-		if (X == 0)
-			IP = Y - 1; //IP will get incremented in a loop afterwards
+			error_at("Y is out of bounds in JZ", ip);
+		ip = X == 0 ? Y : ip + 1;
 	}
-		break;
-	case JNZ:
+		BRANCH();
+	OP(JNZ):
 	{
-		const int32_t Y = pop_DS(), X = pop_DS();
+		NEED_DS(2);
+		const int32_t Y = tos, X = ds[ds_size - 2];
+		DROP_DS(2);
 		if (is_not_in_bounds(Y))
-			error("Y is out of bounds in JZ", true);
-		if (X != 0)
-			IP = Y - 1; //IP will get incremented in a loop afterwards
-	}
-		break;
-	case PUSH:
-		if (is_not_in_bounds(IP, PM_SIZE - sizeof(int32_t) - 1))
-			error("PUSH used without a proper operand", true);
-		DS.push(get_data_from_PM(IP + 1));
-		IP += sizeof(int32_t); // IP will get incremented in a loop afterwards
-		break;
-	case RM:
-		pop_DS();
-		break;
-	case PUSHIP:
-	{
-		const int32_t X = pop_DS();
+			error_at("Y is out of bounds in JZ", ip);
+		ip = X != 0 ? Y : ip + 1;
+	}
+		BRANCH();
+	OP(PUSH):
+		if (is_not_in_bounds(ip, PM_SIZE - sizeof(int32_t) - 1))
+			error_at("PUSH used without a proper operand", ip);
+		if (ds_size == ds_max)
+			error_at("DS overflow", ip);
+		PUSH_DS(get_data_from_PM(ip + 1));
+		NEXT(1 + sizeof(int32_t));
+	OP(RM):
+		NEED_DS(1);
+		DROP_DS(1);
+		NEXT(1);
+	OP(PUSHIP):
+	{
+		NEED_DS(1);
+		const int32_t X = tos;
+		DROP_DS(1);
 		if (is_not_in_bounds(X))
-			error("X is out of bounds in PUSHIP", true);
-		IS.push(X);
-	}
-		break;
-	case POPIP:
-		IP = pop_IS();
-		if (is_not_in_bounds(IP))
-			error("IP is out of bounds in POPIP", true);
-		IP--; // IP will get incremented in a loop afterwards
-		break;
-	case RMIP:
-		pop_IS();
-		break;
-	case PUSHPM:
-	{
-		const int32_t X = pop_DS();
-		if (is_not_in_bounds(X, PM_SIZE - sizeof(int32_t)))
-			error("X is out of bounds in PUSHPM", true);
-		DS.push(get_data_from_PM(X));
+			error_at("X is out of bounds in PUSHIP", ip);
+		if (IS_size == settings.IS_max_depth)
+			error_at("IS overflow", ip);
+		IS[IS_size++] = X;
 	}
-		break;
-	case POPPM:
+		NEXT(1);
+	OP(POPIP):
+		if (IS_size == 0)
+			error_at("Attempted to pop empty IS", ip);
+		ip = IS[--IS_size];
+		if (is_not_in_bounds(ip))
+			error_at("IP is out of bounds in POPIP", ip);
+		BRANCH();
+	OP(RMIP):
+		if (IS_size == 0)
+			error_at("Attempted to pop empty IS", ip);
+		IS_size--;
+		NEXT(1);
+	OP(PUSHPM):
+		NEED_DS(1);
+		if (is_not_in_bounds(tos, PM_SIZE - sizeof(int32_t)))
+			error_at("X is out of bounds in PUSHPM", ip);
+		tos = get_data_from_PM(tos);
+		NEXT(1);
+	OP(POPPM):
 	{
-		int32_t Y = pop_DS();
-		int32_t X = pop_DS();
+		NEED_DS(2);
+		int32_t Y = tos;
+		int32_t X = ds[ds_size - 2];
+		DROP_DS(2);
 		if (is_not_in_bounds(X, PM_SIZE - sizeof(int32_t)))
-			error("X is out of bounds in POPPM", true);
+			error_at("X is out of bounds in POPPM", ip);
+		if (X + sizeof(int32_t) > VIDEOMEM_BEG)
+			mark_video_mem_dirty(X, sizeof(int32_t));
 		for (size_t i = 0; i < sizeof(int32_t); i++)
 			PM[X++] = reinterpret_cast<int8_t*>(&Y)[sizeof(int32_t) - 1 - i];
 	}
-		break;
-	case INPUT:
+		NEXT(1);
+	OP(INPUT):
 	{
+		if (ds_size == ds_max)
+			error_at("DS overflow", ip);
 		int32_t input;
-		std::cin >> input;
-		if (std::cin.fail())
-			error("Invalid input", true);
-		DS.push(input);
-	}
-		break;
-	case PEEK:
-		if (DS.empty())
-			error("Tried to PEEK empty DS", true);
-		std::cout << DS.top() << std::endl;
-		break;
-	case HALT:
+		if (!io->read(input))
+			error_at("Invalid input", ip);
+		PUSH_DS(input);
+	}
+		NEXT(1);
+	OP(PEEK):
+		NEED_DS(1);
+		io->write(tos);
+		NEXT(1);
+	OP(HALT):
 		halt_called = true;
-		break;
-	default:
-		error("Unknown instruction", true);
+		ip++;
+		remaining--;
+		goto slice_end;
+	OP(PUSH8):
+	OP(PUSH16):
+	{
+		const int32_t X = get_short_operand(ip);
+		if (ds_size == ds_max)
+			error_at("DS overflow", ip);
+		PUSH_DS(X);
+	}
+		NEXT(compact_length(PM[ip]));
+	OP(JMPREL8):
+	OP(JMPREL16):
+	{
+		const int32_t X = get_relative_target(ip);
+		if (static_cast<size_t>(X) == ip)
+		{
+			ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+			DS_size = ds_size;
+			IP = ip;
+			limit_error(EmulatorLimitError::InfiniteLoop, "Infinite loop");
+		}
+		ip = X;
 	}
+		BRANCH();
+	OP(JZREL8):
+	OP(JZREL16):
+	{
+		NEED_DS(1);
+		const int32_t X = tos, Y = get_relative_target(ip);
+		DROP_DS(1);
+		ip = X == 0 ? Y : ip + compact_length(PM[ip]);
+	}
+		BRANCH();
+	OP(JNZREL8):
+	OP(JNZREL16):
+	{
+		NEED_DS(1);
+		const int32_t X = tos, Y = get_relative_target(ip);
+		DROP_DS(1);
+		ip = X != 0 ? Y : ip + compact_length(PM[ip]);
+	}
+		BRANCH();
+	OP(CALLREL16):
+	{
+		const int32_t X = get_relative_target(ip);
+		if (IS_size == settings.IS_max_depth)
+			error_at("IS overflow", ip);
+		IS[IS_size++] = ip + compact_length(CALLREL16);
+		ip = X;
+	}
+		BRANCH();
+	OP_DEFAULT:
+		if (ip >= PM_SIZE) // Ran into PM_GUARD
+			goto slice_end;
+		error_at("Unknown instruction", ip);
+	}
+
+slice_end:
+	ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+	DS_size = ds_size;
+	IP = ip;
+
+	return instrs_num - remaining; // remaining may have gone below zero
+
+#undef PUSH_DS
+#undef DROP_DS
+#undef NEED_DS
+#undef BRANCH
+#undef NEXT
+#undef DISPATCH
+#undef OP_DEFAULT
+#undef OP
 }
 
-uint8_t Emulator::get_bit(const uint8_t number, const size_t bit_num)
+void Emulator::decode(const size_t beginning, const size_t end)
 {
-	return (number >> (bit_num - 1)) & 1;
+	const size_t PUSH_LEN = 1 + sizeof(int32_t);
+
+	for (size_t ip = beginning; ip < end; ip++)
+	{
+		DecodedInstr &instr = decoded[ip];
+		instr.op = PM[ip];
+		instr.imm = 0;
+
+		if (instr.op >= PUSH8 && instr.op <= CALLREL16)
+		{
+			// Left out of bounds when the operand is not in PM, so that the handler reports the error
+			const size_t length = compact_length(instr.op);
+			if (is_not_in_bounds(ip, PM_SIZE - length))
+				instr.imm = -1;
+			else
+			{
+				instr.imm = length == 2 ? static_cast<int8_t>(PM[ip + 1]) :
+					static_cast<int16_t>(PM[ip + 1] << 8 | PM[ip + 2]);
+				if (instr.op != PUSH8 && instr.op != PUSH16)
+					instr.imm += static_cast<int32_t>(ip + length);
+			}
+			continue;
+		}
+
+		// A PUSH without a proper operand stays unfused, so that its handler reports the error
+		if (instr.op != PUSH || is_not_in_bounds(ip, PM_SIZE - PUSH_LEN))
+			continue;
+
+		instr.imm = get_data_from_PM(ip + 1);
+
+		switch (PM[ip + PUSH_LEN])
+		{
+		case ADD:
+			instr.op = PUSH_ADD;
+			break;
+		case SUB:
+			instr.op = PUSH_SUB;
+			break;
+		case JMP:
+			if (!is_not_in_bounds(instr.imm))
+				instr.op = PUSH_JMP;
+			break;
+		case JZ:
+			if (!is_not_in_bounds(instr.imm))
+				instr.op = PUSH_JZ;
+			break;
+		case JNZ:
+			if (!is_not_in_bounds(instr.imm))
+				instr.op = PUSH_JNZ;
+			break;
+		}
+	}
 }
 
-void Emulator::draw_video_mem()
+void Emulator::redecode_after_write(const size_t beginning)
 {
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xFF);
-	SDL_RenderClear(renderer);
+	// A fused instruction spans up to 6 cells, so it may start 5 cells before the write
+	const size_t reach = sizeof(int32_t) + 1;
+
+	decode(beginning < reach ? 0 : beginning - reach, beginning + sizeof(int32_t));
+}
+
+/*
+ * Same handlers as execute_threaded(), but the opcode, the PUSH operand and
+ * the relative jump targets come from the decoded array, and PUSH+ADD/SUB/JMP/JZ/JNZ pairs run as one
+ * fused instruction. A fused instruction whose stack check fails falls back
+ * to the plain PUSH handler, so errors are reported exactly as before.
+ */
+size_t Emulator::execute_predecoded(const size_t instrs_num)
+{
+#ifdef QPROC_COMPUTED_GOTO
+#define OP(name) op_##name
+#define OP_DEFAULT op_unknown
+#define DISPATCH() goto *dispatch[code[ip].op]
+#else
+#define OP(name) case name
+#define OP_DEFAULT default
+#define DISPATCH() goto dispatch_top
+#endif
+
+#define NEXT(len, count) do { ip += (len); remaining -= (count); DISPATCH(); } while (0)
+#define BRANCH(count) do { remaining -= (count); if (remaining <= 0) goto slice_end; DISPATCH(); } while (0)
+#define NEED_DS(n) do { if (ds_size < (n)) error_at("Attempted to pop empty DS", ip); } while (0)
+#define DROP_DS(n) do { ds_size -= (n); tos = ds[static_cast<ptrdiff_t>(ds_size) - 1]; } while (0)
+#define PUSH_DS(value) do { ds[static_cast<ptrdiff_t>(ds_size++) - 1] = tos; tos = (value); } while (0)
+
+	const size_t PUSH_LEN = 1 + sizeof(int32_t);
+
+	const DecodedInstr *code = decoded.data();
+	size_t ip = IP;
+	int32_t *ds = DS;
+	size_t ds_size = DS_size;
+	int32_t tos = ds[static_cast<ptrdiff_t>(ds_size) - 1];
+	const size_t ds_max = settings.DS_max_depth;
+	ptrdiff_t remaining = instrs_num;
+
+#ifdef QPROC_COMPUTED_GOTO
+	void *dispatch[256];
+	for (auto &label : dispatch)
+		label = &&op_unknown;
+
+	dispatch[NOP] = &&op_NOP;
+	dispatch[ADD] = &&op_ADD;
+	dispatch[SUB] = &&op_SUB;
+	dispatch[NEG] = &&op_NEG;
+	dispatch[SHL] = &&op_SHL;
+	dispatch[SHR] = &&op_SHR;
+	dispatch[AND] = &&op_AND;
+	dispatch[OR] = &&op_OR;
+	dispatch[XOR] = &&op_XOR;
+	dispatch[NOT] = &&op_NOT;
+	dispatch[JMP] = &&op_JMP;
+	dispatch[JZ] = &&op_JZ;
+	dispatch[JNZ] = &&op_JNZ;
+	dispatch[PUSH] = &&op_PUSH;
+	dispatch[RM] = &&op_RM;
+	dispatch[PUSHIP] = &&op_PUSHIP;
+	dispatch[POPIP] = &&op_POPIP;
+	dispatch[RMIP] = &&op_RMIP;
+	dispatch[PUSHPM] = &&op_PUSHPM;
+	dispatch[POPPM] = &&op_POPPM;
+	dispatch[INPUT] = &&op_INPUT;
+	dispatch[PEEK] = &&op_PEEK;
+	dispatch[HALT] = &&op_HALT;
+	dispatch[PUSH_ADD] = &&op_PUSH_ADD;
+	dispatch[PUSH_SUB] = &&op_PUSH_SUB;
+	dispatch[PUSH_JMP] = &&op_PUSH_JMP;
+	dispatch[PUSH_JZ] = &&op_PUSH_JZ;
+	dispatch[PUSH_JNZ] = &&op_PUSH_JNZ;
+	dispatch[PUSH8] = &&op_PUSH8;
+	dispatch[PUSH16] = &&op_PUSH16;
+	dispatch[JMPREL8] = &&op_JMPREL8;
+	dispatch[JMPREL16] = &&op_JMPREL16;
+	dispatch[JZREL8] = &&op_JZREL8;
+	dispatch[JNZREL8] = &&op_JNZREL8;
+	dispatch[JZREL16] = &&op_JZREL16;
+	dispatch[JNZREL16] = &&op_JNZREL16;
+	dispatch[CALLREL16] = &&op_CALLREL16;
+
+	if (halt_called)
+		goto slice_end;
+	DISPATCH();
+	{
+#else
+	if (halt_called)
+		goto slice_end;
+dispatch_top:
+	switch (code[ip].op)
+	{
+#endif
+	OP(NOP):
+		NEXT(1, 1);
+	OP(ADD):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] + tos;
+		NEXT(1, 1);
+	OP(SUB):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] - tos;
+		NEXT(1, 1);
+	OP(NEG):
+		NEED_DS(1);
+		tos = -tos;
+		NEXT(1, 1);
+	OP(SHL):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] << tos;
+		NEXT(1, 1);
+	OP(SHR):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] >> tos;
+		NEXT(1, 1);
+	OP(AND):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] & tos;
+		NEXT(1, 1);
+	OP(OR):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] | tos;
+		NEXT(1, 1);
+	OP(XOR):
+		NEED_DS(2);
+		tos = ds[ds_size-- - 2] ^ tos;
+		NEXT(1, 1);
+	OP(NOT):
+		NEED_DS(1);
+		tos = ~tos;
+		NEXT(1, 1);
+	OP(JMP):
+	{
+		NEED_DS(1);
+		const int32_t X = tos;
+		DROP_DS(1);
+		if (is_not_in_bounds(X))
+			error_at("X is out of bounds in JMP", ip);
+		if (static_cast<size_t>(X) + 1 + sizeof(int32_t) == ip && is_self_loop(X))
+		{
+			ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+			DS_size = ds_size;
+			IP = X;
+			limit_error(EmulatorLimitError::InfiniteLoop, "Infinite loop");
+		}
+		ip = X;
+	}
+		BRANCH(1);
+	OP(JZ):
+	{
+		NEED_DS(2);
+		const int32_t Y = tos, X = ds[ds_size - 2];
+		DROP_DS(2);
+		if (is_not_in_bounds(Y))
+			error_at("Y is out of bounds in JZ", ip);
+		ip = X == 0 ? Y : ip + 1;
+	}
+		BRANCH(1);
+	OP(JNZ):
+	{
+		NEED_DS(2);
+		const int32_t Y = tos, X = ds[ds_size - 2];
+		DROP_DS(2);
+		if (is_not_in_bounds(Y))
+			error_at("Y is out of bounds in JZ", ip);
+		ip = X != 0 ? Y : ip + 1;
+	}
+		BRANCH(1);
+	OP(PUSH):
+	op_PUSH_slow:
+		if (is_not_in_bounds(ip, PM_SIZE - PUSH_LEN))
+			error_at("PUSH used without a proper operand", ip);
+		if (ds_size == ds_max)
+			error_at("DS overflow", ip);
+		PUSH_DS(code[ip].imm);
+		NEXT(PUSH_LEN, 1);
+	OP(RM):
+		NEED_DS(1);
+		DROP_DS(1);
+		NEXT(1, 1);
+	OP(PUSHIP):
+	{
+		NEED_DS(1);
+		const int32_t X = tos;
+		DROP_DS(1);
+		if (is_not_in_bounds(X))
+			error_at("X is out of bounds in PUSHIP", ip);
+		if (IS_size == settings.IS_max_depth)
+			error_at("IS overflow", ip);
+		IS[IS_size++] = X;
+	}
+		NEXT(1, 1);
+	OP(POPIP):
+		if (IS_size == 0)
+			error_at("Attempted to pop empty IS", ip);
+		ip = IS[--IS_size];
+		if (is_not_in_bounds(ip))
+			error_at("IP is out of bounds in POPIP", ip);
+		BRANCH(1);
+	OP(RMIP):
+		if (IS_size == 0)
+			error_at("Attempted to pop empty IS", ip);
+		IS_size--;
+		NEXT(1, 1);
+	OP(PUSHPM):
+		NEED_DS(1);
+		if (is_not_in_bounds(tos, PM_SIZE - sizeof(int32_t)))
+			error_at("X is out of bounds in PUSHPM", ip);
+		tos = get_data_from_PM(tos);
+		NEXT(1, 1);
+	OP(POPPM):
+	{
+		NEED_DS(2);
+		int32_t Y = tos;
+		int32_t X = ds[ds_size - 2];
+		DROP_DS(2);
+		if (is_not_in_bounds(X, PM_SIZE - sizeof(int32_t)))
+			error_at("X is out of bounds in POPPM", ip);
+		if (X + sizeof(int32_t) > VIDEOMEM_BEG)
+			mark_video_mem_dirty(X, sizeof(int32_t));
+
+		const size_t beginning = X;
+		bool changed = false;
+		for (size_t i = 0; i < sizeof(int32_t); i++)
+		{
+			const uint8_t byte = reinterpret_cast<int8_t*>(&Y)[sizeof(int32_t) - 1 - i];
+			changed |= PM[X] != byte;
+			PM[X++] = byte;
+		}
+
+		if (changed)
+			redecode_after_write(beginning);
+	}
+		NEXT(1, 1);
+	OP(INPUT):
+	{
+		if (ds_size == ds_max)
+			error_at("DS overflow", ip);
+		int32_t input;
+		if (!io->read(input))
+			error_at("Invalid input", ip);
+		PUSH_DS(input);
+	}
+		NEXT(1, 1);
+	OP(PEEK):
+		NEED_DS(1);
+		io->write(tos);
+		NEXT(1, 1);
+	OP(HALT):
+		halt_called = true;
+		ip++;
+		remaining--;
+		goto slice_end;
+	OP(PUSH_ADD):
+		if (ds_size < 1 || ds_size == ds_max)
+			goto op_PUSH_slow;
+		tos += code[ip].imm;
+		NEXT(PUSH_LEN + 1, 2);
+	OP(PUSH_SUB):
+		if (ds_size < 1 || ds_size == ds_max)
+			goto op_PUSH_slow;
+		tos -= code[ip].imm;
+		NEXT(PUSH_LEN + 1, 2);
+	OP(PUSH_JMP):
+		if (ds_size == ds_max)
+			goto op_PUSH_slow;
+		if (static_cast<size_t>(code[ip].imm) == ip)
+		{
+			ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+			DS_size = ds_size;
+			IP = ip;
+			limit_error(EmulatorLimitError::InfiniteLoop, "Infinite loop");
+		}
+		ip = code[ip].imm;
+		BRANCH(2);
+	OP(PUSH_JZ):
+	{
+		if (ds_size < 1 || ds_size == ds_max)
+			goto op_PUSH_slow;
+		const int32_t X = tos;
+		DROP_DS(1);
+		ip = X == 0 ? code[ip].imm : ip + PUSH_LEN + 1;
+	}
+		BRANCH(2);
+	OP(PUSH_JNZ):
+	{
+		if (ds_size < 1 || ds_size == ds_max)
+			goto op_PUSH_slow;
+		const int32_t X = tos;
+		DROP_DS(1);
+		ip = X != 0 ? code[ip].imm : ip + PUSH_LEN + 1;
+	}
+		BRANCH(2);
+	OP(PUSH8):
+	OP(PUSH16):
+		if (is_not_in_bounds(ip, PM_SIZE - compact_length(code[ip].op)))
+			error_at("Compact instruction used without a proper operand", ip);
+		if (ds_size == ds_max)
+			error_at("DS overflow", ip);
+		PUSH_DS(code[ip].imm);
+		NEXT(compact_length(code[ip].op), 1);
+	OP(JMPREL8):
+	OP(JMPREL16):
+	{
+		int32_t X = code[ip].imm;
+		if (is_not_in_bounds(X))
+			X = get_relative_target(ip); // Reports the error
+		if (static_cast<size_t>(X) == ip)
+		{
+			ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+			DS_size = ds_size;
+			IP = ip;
+			limit_error(EmulatorLimitError::InfiniteLoop, "Infinite loop");
+		}
+		ip = X;
+	}
+		BRANCH(1);
+	OP(JZREL8):
+	OP(JZREL16):
+	OP(JNZREL8):
+	OP(JNZREL16):
+	{
+		NEED_DS(1);
+		int32_t Y = code[ip].imm;
+		if (is_not_in_bounds(Y))
+			Y = get_relative_target(ip);
+		const bool taken = (tos == 0) == (code[ip].op == JZREL8 || code[ip].op == JZREL16);
+		DROP_DS(1);
+		ip = taken ? Y : ip + compact_length(code[ip].op);
+	}
+		BRANCH(1);
+	OP(CALLREL16):
+	{
+		int32_t X = code[ip].imm;
+		if (is_not_in_bounds(X))
+			X = get_relative_target(ip);
+		if (IS_size == settings.IS_max_depth)
+			error_at("IS overflow", ip);
+		IS[IS_size++] = ip + compact_length(CALLREL16);
+		ip = X;
+	}
+		BRANCH(1);
+	OP_DEFAULT:
+		if (ip >= PM_SIZE) // Ran into PM_GUARD
+			goto slice_end;
+		error_at("Unknown instruction", ip);
+	}
+
+slice_end:
+	ds[static_cast<ptrdiff_t>(ds_size) - 1] = tos;
+	DS_size = ds_size;
+	IP = ip;
+
+	return instrs_num - remaining; // remaining may have gone below zero
+
+#undef PUSH_DS
+#undef DROP_DS
+#undef NEED_DS
+#undef BRANCH
+#undef NEXT
+#undef DISPATCH
+#undef OP_DEFAULT
+#undef OP
+}
 
-	const size_t VIDEOMEM_SIZE = WINDOW_W * WINDOW_H;
-	const size_t VIDEOMEM_BEG = PM_SIZE - VIDEOMEM_SIZE;
+/*
+ * Runs compiled blocks looked up by IP. Instructions the JIT does not
+ * translate, and instructions a block bails out on, go through
+ * execute_switch() one at a time. Compiled POPPM never writes into code or
+ * video memory, so self-modifying writes always end up here and invalidate
+ * the blocks they touch.
+ */
+size_t Emulator::execute_jit(const size_t instrs_num)
+{
+	JitState state = { DS, DS_size, 0, 0, IS, IS_size };
+	ptrdiff_t remaining = instrs_num;
 
-	for (int i = 0; i < VIDEOMEM_SIZE; i++)
+	while (remaining > 0 && !halt_called && IP < PM_SIZE)
 	{
-		const uint8_t pixel = PM[VIDEOMEM_BEG + i];
+		if (PM[IP] == PUSH && is_self_loop(IP))
+			limit_error(EmulatorLimitError::InfiniteLoop, "Infinite loop");
+
+		const Jit::Block &block = jit->get_block(IP);
+		if (block.code != nullptr)
+		{
+			state.ds_size = DS_size;
+			state.is_size = IS_size;
+			state.interpret = 0;
+
+			IP = block.code(&state);
+			DS_size = state.ds_size;
+			IS_size = state.is_size;
+			remaining -= state.executed;
+
+			if (!state.interpret)
+				continue;
+		}
+
+		const bool is_POPPM = PM[IP] == POPPM && DS_size >= 2;
+		const int32_t X = is_POPPM ? DS[DS_size - 2] : 0;
+
+		execute_switch<false>(1);
+		remaining--;
+
+		if (is_POPPM) // execute_switch() would have thrown if X was out of bounds
+			jit->invalidate(X, X + sizeof(int32_t));
+	}
 
+	return instrs_num - remaining;
+}
+
+uint8_t Emulator::get_bit(const uint8_t number, const size_t bit_num)
+{
+	return (number >> (bit_num - 1)) & 1;
+}
+
+void Emulator::init_palette()
+{
+	for (size_t pixel = 0; pixel < PALETTE_SIZE; pixel++)
+	{
 		const uint8_t intensity = 128 * get_bit(pixel, 4),
 						r = intensity + 127 * get_bit(pixel, 3),
 						g = intensity + 127 * get_bit(pixel, 2),
 						b = intensity + 127 * get_bit(pixel, 1);
 
-		SDL_SetRenderDrawColor(renderer, r, g, b, 0xFF);
-		SDL_RenderDrawPoint(renderer, i % WINDOW_W, i / WINDOW_W);
+		palette[pixel] = 0xFF000000 | (r << 16) | (g << 8) | b;
 	}
+}
+
+void Emulator::mark_video_mem_dirty(const size_t beginning, const size_t length)
+{
+	const size_t first = beginning < VIDEOMEM_BEG ? 0 : beginning - VIDEOMEM_BEG;
+	const size_t last = beginning + length - 1 - VIDEOMEM_BEG;
+
+	const int first_row = first / WINDOW_W, last_row = last / WINDOW_W;
+	if (first_row < dirty_row_first)
+		dirty_row_first = first_row;
+	if (last_row > dirty_row_last)
+		dirty_row_last = last_row;
+}
+
+void Emulator::draw_video_mem()
+{
+	if (dirty_row_first > dirty_row_last) // Nothing has changed since the last frame
+		return;
+
+	const size_t first = dirty_row_first * WINDOW_W;
+	const size_t count = (dirty_row_last - dirty_row_first + 1) * WINDOW_W;
+
+	const uint8_t *src = PM + VIDEOMEM_BEG + first;
+	uint32_t *dst = frame_buffer.data() + first;
+	for (size_t i = 0; i < count; i++)
+		dst[i] = palette[src[i] & (PALETTE_SIZE - 1)];
 
+	const SDL_Rect rect = { 0, dirty_row_first, WINDOW_W, dirty_row_last - dirty_row_first + 1 };
+	SDL_UpdateTexture(texture, &rect, dst, WINDOW_W * sizeof(uint32_t));
+
+	SDL_RenderClear(renderer);
+	SDL_RenderCopy(renderer, texture, nullptr, nullptr);
 	SDL_RenderPresent(renderer);
+
+	dirty_row_first = WINDOW_H;
+	dirty_row_last = -1;
+}
+
+void Emulator::dump_video_mem(const std::string filename)
+{
+	std::vector<uint8_t> rgb(VIDEOMEM_SIZE * 3);
+	for (size_t i = 0; i < VIDEOMEM_SIZE; i++)
+	{
+		const uint32_t pixel = palette[PM[VIDEOMEM_BEG + i] & (PALETTE_SIZE - 1)];
+
+		rgb[i * 3] = (pixel >> 16) & 0xFF;
+		rgb[i * 3 + 1] = (pixel >> 8) & 0xFF;
+		rgb[i * 3 + 2] = pixel & 0xFF;
+	}
+
+	std::ofstream output(filename, std::ios::binary | std::ios::trunc);
+	if (!output.is_open())
+		error("Could not open the video memory dump file", false);
+
+	output << "P6\n" << WINDOW_W << " " << WINDOW_H << "\n255\n";
+	output.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+}
+
+void Emulator::error_at(const std::string msg, const size_t ip)
+{
+	IP = ip;
+	error(msg, true);
+}
+
+void Emulator::limit_error(const EmulatorLimitError::Kind kind, const std::string msg)
+{
+	io->flush();
+
+	throw EmulatorLimitError(kind, "ERROR: " + msg + " ; Instruction #" + std::to_string(IP) +
+		"\n" + dump_state());
+}
+
+std::string Emulator::dump_state()
+{
+	const size_t SHOWN_CELLS = 8;
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+	std::string dump = "Instructions executed by the last slice boundary: " + std::to_string(instrs_executed) +
+		", seconds: " + std::to_string(seconds) + "\n";
+
+	dump += "IP: " + std::to_string(IP);
+	if (IP < PM_SIZE)
+		dump += ", opcode: " + std::to_string(PM[IP]);
+
+	dump += "\nDS (" + std::to_string(DS_size) + " deep, top first):";
+	for (size_t i = 0; i < DS_size && i < SHOWN_CELLS; i++)
+		dump += " " + std::to_string(DS[DS_size - 1 - i]);
+
+	dump += "\nIS (" + std::to_string(IS_size) + " deep, top first):";
+	for (size_t i = 0; i < IS_size && i < SHOWN_CELLS; i++)
+		dump += " " + std::to_string(IS[IS_size - 1 - i]);
+
+	return dump;
 }
 
 void Emulator::error(const std::string msg, bool print_instr_number)
 {
+    io->flush(); // Output produced before the error goes first
+
     std::string exception_text = "ERROR: " + msg;
     if (print_instr_number)
         exception_text += " ; Instruction #" + std::to_string(IP);
@@ -3,48 +3,229 @@
 
 #include <SDL.h>
 
+#include "../../image/Image.hpp"
+
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
-#include <stack>
 #include <string>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+class IOChannel;
+class Jit;
+class Profiler;
+
+enum class EmulatorEngine
+{
+	Switch,		// Reference interpreter
+	Threaded,	// Computed goto dispatch (falls back to a switch on non-GNU compilers)
+	Predecoded,	// Threaded dispatch over a pre-decoded copy of PM with fused instructions
+	Jit			// x86-64 translation of basic blocks, falls back to Threaded on other hosts
+};
+
+struct EmulatorSettings
+{
+	EmulatorEngine engine = EmulatorEngine::Threaded;
+
+	double frame_rate = 60.0; // Video refresh rate in Hz, 0 - present after every slice
+	size_t instrs_per_frame = 100000; // Instructions executed between two frame checks
+	uint64_t max_instrs = 0; // Instruction budget, checked at slice (basic block) boundaries, 0 - no limit
+	double max_seconds = 0; // Wall-clock watchdog of a run(), checked at the same points, 0 - no limit
+
+	bool headless = false; // Do not initialize SDL, no video output window
+	bool quiet = false; // Do not print the ROM size and load time
+	std::string dump_path; // Video memory dumps are written to dump_path_*.ppm, empty - no dumps
+	size_t dump_every_frames = 0; // Dump every N frames, 0 - only when the program stops
+
+	std::string profile_path; // Write a profile report there when the program stops, empty - no profiling
+
+	std::string snapshot_path; // Machine state snapshots are written there, empty - no snapshots
+	uint64_t snapshot_every = 0; // Take a snapshot every N instructions (at a slice boundary), 0 - never
+	bool snapshot_async = true; // Write snapshots from a forked copy of the process where possible
+
+	size_t DS_max_depth = 65536; // Maximum number of data words on DS
+	size_t IS_max_depth = 65536; // Maximum number of addresses on IS
+
+	std::shared_ptr<IOChannel> io; // Source of INPUT and sink of PEEK, nullptr - std::cin / std::cout
+};
+
+// Thrown when a program is stopped for running too long or looping forever, what() includes a state dump
+class EmulatorLimitError : public std::runtime_error
+{
+public:
+	enum Kind { InstructionBudget, Watchdog, InfiniteLoop };
+
+	EmulatorLimitError(const Kind kind, const std::string &msg) : std::runtime_error(msg), kind(kind) {}
+
+	const Kind kind;
+};
 
 class Emulator
 {
 public:
-    Emulator(const std::string filename);
+    Emulator(const std::string filename, const EmulatorSettings settings = EmulatorSettings());
+	Emulator(const EmulatorSettings settings = EmulatorSettings()); // Call load() before run()
 	~Emulator();
 
+	// Replaces the ROM and resets the machine, the video output and the engine caches are reused
+	void load(const std::string filename);
+	void set_io(std::shared_ptr<IOChannel> io);
+	void set_dump_path(const std::string dump_path);
+	void set_profile_path(const std::string profile_path); // Only if profiling was enabled in the settings
+	void set_snapshot_path(const std::string snapshot_path);
+
+	// PM is stored as a difference from the ROM, so restore after loading the same ROM
+	void save_snapshot(const std::string filename);
+	void restore_snapshot(const std::string filename);
+
     void run();
 
+	uint64_t get_instrs_executed() const { return instrs_executed; }
+
+	enum Opcode
+	{
+		NOP = 0x00,
+		ADD = 0x01,
+		SUB = 0x02,
+		NEG = 0x03,
+		SHL = 0x04,
+		SHR = 0x05,
+		AND = 0x06,
+		OR = 0x07,
+		XOR = 0x08,
+		NOT = 0x09,
+		JMP = 0x0A,
+		JZ = 0x0B,
+		JNZ = 0x0C,
+		PUSH = 0x0D,
+		RM = 0x0E,
+		PUSHIP = 0x0F,
+		POPIP = 0x10,
+		RMIP = 0x11,
+		PUSHPM = 0x12,
+		POPPM = 0x13,
+		INPUT = 0x14,
+		PEEK = 0x15,
+		HALT = 0x16,
+
+		// Compact encoding, only emitted by the assembler's --compact mode. Operands are
+		// big-endian and signed, displacements are relative to the next instruction
+		PUSH8 = 0x17,
+		PUSH16 = 0x18,
+		JMPREL8 = 0x19,
+		JMPREL16 = 0x1A,
+		JZREL8 = 0x1B, // Pop X, jump if X == 0
+		JNZREL8 = 0x1C,
+		JZREL16 = 0x1D,
+		JNZREL16 = 0x1E,
+		CALLREL16 = 0x1F, // Push the next address onto IS, jump
+
+		PM_GUARD = 0xFF // Never a valid opcode, stored right after the last PM cell
+	};
+
 private:
-    size_t pop_IS();
-    int32_t pop_DS();
+	enum FusedOpcode // Only appear in the pre-decoded program
+	{
+		PUSH_ADD = 0x20,
+		PUSH_SUB = 0x21,
+		PUSH_JMP = 0x22, // Only formed when the target is in bounds
+		PUSH_JZ = 0x23,
+		PUSH_JNZ = 0x24
+	};
+
+	struct DecodedInstr
+	{
+		int32_t imm; // PUSH operand, already in host byte order, or the absolute target of a relative jump
+		uint8_t op;
+	};
+
+	// All return the number of instructions executed
+	size_t execute(const size_t instrs_num);
+	template <bool Profiled> // The profiling instantiation is only used when profiling is on
+	size_t execute_switch(const size_t instrs_num);
+	size_t execute_threaded(const size_t instrs_num);
+	size_t execute_predecoded(const size_t instrs_num);
+	size_t execute_jit(const size_t instrs_num);
+
+	void decode(const size_t beginning, const size_t end);
+	void redecode_after_write(const size_t beginning);
+	void handle_frame(const bool force);
 
     int32_t get_data_from_PM(const size_t beginning);
+	int32_t get_short_operand(const size_t ip); // PUSH8 .. CALLREL16, sign-extended
+	int32_t get_relative_target(const size_t ip);
+	static size_t compact_length(const uint8_t op)
+	{
+		return op == PUSH8 || op == JMPREL8 || op == JZREL8 || op == JNZREL8 ? 2 : 3;
+	}
 
     bool is_not_in_bounds(const int32_t value, const size_t right_bound = PM_SIZE - 1);
+	bool is_self_loop(const size_t push_ip); // PUSH push_ip; JMP
 
-	void do_instruction();
-	
 	uint8_t get_bit(const uint8_t number, const size_t bit_num);
+	void init_palette();
+	void mark_video_mem_dirty(const size_t beginning, const size_t length);
 	void draw_video_mem();
+	void dump_video_mem(const std::string filename);
 
+	void capture_snapshot();
+	void wait_for_snapshot();
+
+    void error_at(const std::string msg, const size_t ip);
+	void limit_error(const EmulatorLimitError::Kind kind, const std::string msg);
+	std::string dump_state();
     void error(const std::string msg, bool print_instr_number);
 
     static const size_t PM_SIZE = 204800;
-    uint8_t PM[PM_SIZE] = {0};
+    std::unique_ptr<Image> image; // ROM loaded into a writable PM_SIZE + 1 cell region
+    uint8_t *PM; // PM[PM_SIZE] == PM_GUARD
+
+    std::vector<DecodedInstr> decoded; // One entry per PM cell, plus one for PM_GUARD
+    std::unique_ptr<Jit> jit; // nullptr when the JIT is not used
+	std::unique_ptr<Profiler> profiler; // nullptr when profiling is off
 
     size_t IP = 0;
-    std::stack<size_t> IS;
+    std::vector<size_t> IS_mem;
+    size_t *IS;
+    size_t IS_size;
 
-    std::stack<int32_t> DS;
+    std::vector<int32_t> DS_mem; // DS_mem[0] is a sentinel cell, DS == &DS_mem[1]
+    int32_t *DS;
+    size_t DS_size;
 
 	bool halt_called;
+	uint64_t instrs_executed = 0;
+	std::chrono::steady_clock::time_point run_start;
 
 	static const int WINDOW_W = 320, WINDOW_H = 200;
+	static const size_t VIDEOMEM_SIZE = WINDOW_W * WINDOW_H;
+	static const size_t VIDEOMEM_BEG = PM_SIZE - VIDEOMEM_SIZE;
+
+	static const size_t PALETTE_SIZE = 16; // 4-bit IRGB pixels
+	uint32_t palette[PALETTE_SIZE];
+	std::vector<uint32_t> frame_buffer; // ARGB8888 copy of the video memory
+
+	int dirty_row_first, dirty_row_last; // Rows of the video memory changed since the last frame
+
+	const EmulatorSettings settings;
+	std::shared_ptr<IOChannel> io;
+	std::string dump_path;
+	std::string profile_path;
+
+	std::string rom_path;
+	std::string snapshot_path;
+	uint64_t next_snapshot = 0; // instrs_executed of the next snapshot
+	int snapshot_writer = 0; // pid of the forked process writing a snapshot, 0 - none
+
+	std::chrono::steady_clock::time_point last_frame_time;
+	std::chrono::steady_clock::duration frame_interval;
+	size_t frames_num = 0;
 
 	SDL_Window *window = nullptr;
 	SDL_Renderer *renderer = nullptr;
+	SDL_Texture *texture = nullptr;
 };
 
 #endif
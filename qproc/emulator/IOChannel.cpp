@@ -0,0 +1,147 @@
+#include "IOChannel.hpp"
+
+#include <cctype>
+#include <climits>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+IOChannel::IOChannel(std::ostream &out) :
+	out(out), buffer(BUFFER_SIZE)
+{}
+
+IOChannel::~IOChannel()
+{
+	flush();
+}
+
+void IOChannel::write(const int32_t value)
+{
+	const size_t MAX_LEN = 12; // "-2147483648\n"
+	if (used + MAX_LEN > BUFFER_SIZE)
+		flush();
+
+	char digits[MAX_LEN];
+	size_t len = 0;
+
+	uint32_t magnitude = value < 0 ? 0u - static_cast<uint32_t>(value) : value;
+	do
+	{
+		digits[len++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude != 0);
+
+	if (value < 0)
+		buffer[used++] = '-';
+	while (len > 0)
+		buffer[used++] = digits[--len];
+	buffer[used++] = '\n';
+}
+
+void IOChannel::flush()
+{
+	if (used == 0)
+		return;
+
+	out.write(buffer.data(), used);
+	out.flush();
+	used = 0;
+}
+
+StreamIOChannel::StreamIOChannel(std::istream &in, std::ostream &out) :
+	IOChannel(out), in(in)
+{}
+
+bool StreamIOChannel::read(int32_t &value)
+{
+	flush(); // The program may be waiting for an interactive user, like std::cin tied to std::cout
+
+	in >> value;
+	return !in.fail();
+}
+
+BufferIOChannel::BufferIOChannel(const std::string input, std::ostream &out) :
+	IOChannel(out), input(input)
+{}
+
+std::string BufferIOChannel::read_file(const std::string filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		throw std::runtime_error("ERROR: Could not open the input file");
+
+	std::ostringstream contents;
+	contents << file.rdbuf();
+
+	return contents.str();
+}
+
+bool BufferIOChannel::read(int32_t &value)
+{
+	// Same rules as operator>>: skip whitespace, optional sign, stop at the first non-digit
+	while (pos < input.size() && isspace(static_cast<unsigned char>(input[pos])))
+		pos++;
+
+	bool negative = false;
+	if (pos < input.size() && (input[pos] == '-' || input[pos] == '+'))
+		negative = input[pos++] == '-';
+
+	if (pos >= input.size() || !isdigit(static_cast<unsigned char>(input[pos])))
+		return false;
+
+	int64_t result = 0;
+	while (pos < input.size() && isdigit(static_cast<unsigned char>(input[pos])))
+	{
+		result = result * 10 + (input[pos++] - '0');
+		if (result > static_cast<int64_t>(INT32_MAX) + 1)
+			return false;
+	}
+
+	if (negative)
+		result = -result;
+	if (result > INT32_MAX)
+		return false;
+
+	value = static_cast<int32_t>(result);
+	return true;
+}
+
+RingIOChannel::RingIOChannel(const size_t capacity, std::ostream &out) :
+	IOChannel(out), ring(capacity), mask(capacity - 1), head(0), tail(0), closed(false)
+{
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+		throw std::runtime_error("ERROR: Ring capacity should be a power of 2");
+}
+
+void RingIOChannel::push(const int32_t value)
+{
+	const size_t cur_tail = tail.load(std::memory_order_relaxed);
+	while (cur_tail - head.load(std::memory_order_acquire) == ring.size())
+		std::this_thread::yield(); // The ring is full, wait for the emulator
+
+	ring[cur_tail & mask] = value;
+	tail.store(cur_tail + 1, std::memory_order_release);
+}
+
+void RingIOChannel::close()
+{
+	closed.store(true, std::memory_order_release);
+}
+
+bool RingIOChannel::read(int32_t &value)
+{
+	const size_t cur_head = head.load(std::memory_order_relaxed);
+	while (tail.load(std::memory_order_acquire) == cur_head)
+	{
+		// close() may race with a final push(), so look at tail once more
+		if (closed.load(std::memory_order_acquire) && tail.load(std::memory_order_acquire) == cur_head)
+			return false;
+		std::this_thread::yield();
+	}
+
+	value = ring[cur_head & mask];
+	head.store(cur_head + 1, std::memory_order_release);
+
+	return true;
+}
@@ -0,0 +1,85 @@
+#ifndef IOCHANNEL_HPP
+#define IOCHANNEL_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+ * Source of INPUT values and sink of PEEK values. Output is buffered and
+ * only written out when the buffer fills up or flush() is called.
+ */
+class IOChannel
+{
+public:
+	IOChannel(std::ostream &out);
+	virtual ~IOChannel();
+
+	virtual bool read(int32_t &value) = 0; // false - no valid input left
+
+	void write(const int32_t value);
+	void flush();
+
+private:
+	static const size_t BUFFER_SIZE = 64 * 1024;
+
+	std::ostream &out;
+	std::vector<char> buffer;
+	size_t used = 0;
+};
+
+// Reads input from a stream, e.g. std::cin
+class StreamIOChannel : public IOChannel
+{
+public:
+	StreamIOChannel(std::istream &in, std::ostream &out);
+
+	bool read(int32_t &value) override;
+
+private:
+	std::istream &in;
+};
+
+// All input is known upfront, either given directly or read from a file at once
+class BufferIOChannel : public IOChannel
+{
+public:
+	BufferIOChannel(const std::string input, std::ostream &out);
+
+	static std::string read_file(const std::string filename);
+
+	bool read(int32_t &value) override;
+
+private:
+	const std::string input;
+	size_t pos = 0;
+};
+
+/*
+ * Input is fed by a producer thread through a single-producer,
+ * single-consumer ring buffer. read() waits for the producer and fails
+ * once the ring is empty and closed.
+ */
+class RingIOChannel : public IOChannel
+{
+public:
+	RingIOChannel(const size_t capacity, std::ostream &out);
+
+	void push(const int32_t value); // Producer side
+	void close(); // Producer side, no more input will come
+
+	bool read(int32_t &value) override;
+
+private:
+	std::vector<int32_t> ring;
+	const size_t mask;
+
+	std::atomic<size_t> head; // Next cell to read
+	std::atomic<size_t> tail; // Next cell to write
+	std::atomic<bool> closed;
+};
+
+#endif
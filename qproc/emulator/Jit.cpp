@@ -0,0 +1,485 @@
+#include "Jit.hpp"
+
+#include "Emulator.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define QPROC_JIT_SUPPORTED // System V calling convention, mmap()
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+	/*
+	 * Register usage inside a block:
+	 * RDI - JitState*, RSI - DS base, R8 - DS size at block entry,
+	 * RDX - &DS[DS size at block entry], R11 - PM base, EAX - DS top,
+	 * ECX, R9, R10 - scratch.
+	 */
+	const uint8_t MODRM_EAX_RDX_DISP32 = 0x82; // [RDX + disp32], reg = EAX
+	const uint8_t MODRM_ECX_RDX_DISP32 = 0x8A; // [RDX + disp32], reg = ECX
+
+	const uint8_t JB = 0x82, JAE = 0x83, JZ = 0x84, JNZ = 0x85, JA = 0x87;
+
+	const uint8_t JIT_STATE_DS_SIZE = 8, JIT_STATE_INTERPRET = 16, JIT_STATE_EXECUTED = 24,
+		JIT_STATE_IS = 32, JIT_STATE_IS_SIZE = 40;
+	static_assert(offsetof(JitState, ds_size) == JIT_STATE_DS_SIZE &&
+		offsetof(JitState, interpret) == JIT_STATE_INTERPRET &&
+		offsetof(JitState, executed) == JIT_STATE_EXECUTED &&
+		offsetof(JitState, is) == JIT_STATE_IS &&
+		offsetof(JitState, is_size) == JIT_STATE_IS_SIZE, "Unexpected JitState layout");
+}
+
+Jit::Jit(uint8_t *PM, const size_t PM_size, const size_t write_limit,
+	const size_t ds_max, const size_t is_max) :
+	PM(PM), PM_size(PM_size), write_limit(write_limit), ds_max(ds_max), is_max(is_max),
+	blocks(PM_size + 1), page_blocks((PM_size >> PAGE_SHIFT) + 1),
+	code_cells(PM_size + sizeof(int32_t), 0)
+{
+	if (ds_max > INT32_MAX / sizeof(int32_t) || is_max > INT32_MAX)
+		error("Stacks are too deep for the JIT");
+	if (write_limit < sizeof(int32_t) || write_limit > PM_size)
+		error("Invalid JIT write limit");
+
+#ifdef QPROC_JIT_SUPPORTED
+	void *mem = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		error("Failed to allocate executable memory");
+
+	arena = static_cast<uint8_t*>(mem);
+#else
+	error("The JIT is not supported on this host");
+#endif
+}
+
+Jit::~Jit()
+{
+#ifdef QPROC_JIT_SUPPORTED
+	if (arena != nullptr)
+		munmap(arena, ARENA_SIZE);
+#endif
+}
+
+bool Jit::is_supported()
+{
+#ifdef QPROC_JIT_SUPPORTED
+	// Hardened kernels may refuse writable and executable mappings
+	void *mem = mmap(nullptr, 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return false;
+
+	munmap(mem, 4096);
+	return true;
+#else
+	return false;
+#endif
+}
+
+const Jit::Block &Jit::get_block(const size_t ip)
+{
+	if (blocks[ip].end == 0)
+		compile(ip);
+
+	return blocks[ip];
+}
+
+void Jit::invalidate(const size_t beginning, const size_t end)
+{
+	for (size_t page = beginning >> PAGE_SHIFT; page <= (end - 1) >> PAGE_SHIFT; page++)
+	{
+		std::vector<uint32_t> &starts = page_blocks[page];
+		for (size_t i = 0; i < starts.size();)
+		{
+			Block &block = blocks[starts[i]];
+			if (block.end == 0 || (starts[i] < end && block.end > beginning))
+			{
+				block = Block{ nullptr, 0 };
+				starts[i] = starts.back();
+				starts.pop_back();
+			}
+			else
+				i++;
+		}
+
+		// Blocks may overlap, so rebuild the page's code map from the ones that are left
+		const size_t page_beginning = page << PAGE_SHIFT;
+		const size_t page_end = std::min((page + 1) << PAGE_SHIFT, PM_size + 1);
+		std::fill(code_cells.begin() + page_beginning, code_cells.begin() + page_end, 0);
+		for (const uint32_t start : starts)
+			std::fill(code_cells.begin() + std::max<size_t>(start, page_beginning),
+				code_cells.begin() + std::min<size_t>(blocks[start].end, page_end), 1);
+	}
+}
+
+void Jit::compile(const size_t start)
+{
+	struct Instr
+	{
+		size_t ip;
+		uint8_t op;
+		int32_t imm;
+	};
+
+	const size_t PUSH_LEN = 1 + sizeof(int32_t);
+
+	// Find the end of the block and its DS effect
+	std::vector<Instr> instrs;
+	int depth = 0, need = 0, grow = 0;
+	bool terminated = false;
+	size_t ip = start;
+	while (!terminated && instrs.size() < MAX_BLOCK_INSTRS && ip < PM_size)
+	{
+		Instr instr = { ip, PM[ip], 0 };
+		int pops = 0, pushes = 0;
+		size_t len = 1;
+
+		switch (instr.op)
+		{
+		case Emulator::NOP:
+		case Emulator::RMIP:
+			break;
+		case Emulator::ADD: case Emulator::SUB: case Emulator::SHL: case Emulator::SHR:
+		case Emulator::AND: case Emulator::OR: case Emulator::XOR:
+			pops = 2;
+			pushes = 1;
+			break;
+		case Emulator::NEG: case Emulator::NOT: case Emulator::PUSHPM:
+			pops = 1;
+			pushes = 1;
+			break;
+		case Emulator::RM: case Emulator::PUSHIP:
+			pops = 1;
+			break;
+		case Emulator::POPPM:
+			pops = 2;
+			break;
+		case Emulator::JMP:
+			pops = 1;
+			terminated = true;
+			break;
+		case Emulator::JZ: case Emulator::JNZ:
+			pops = 2;
+			terminated = true;
+			break;
+		case Emulator::POPIP:
+			terminated = true;
+			break;
+		case Emulator::PUSH:
+			if (ip > PM_size - PUSH_LEN || depth + 1 > static_cast<int>(ds_max))
+				goto block_end;
+			instr.imm = static_cast<int32_t>((static_cast<uint32_t>(PM[ip + 1]) << 24) |
+				(PM[ip + 2] << 16) | (PM[ip + 3] << 8) | PM[ip + 4]);
+			pushes = 1;
+			len = PUSH_LEN;
+			break;
+		default:
+			goto block_end;
+		}
+
+		if (pops - depth > need)
+			need = pops - depth;
+		depth += pushes - pops;
+		if (depth > grow)
+			grow = depth;
+
+		ip += len;
+		instrs.push_back(instr);
+	}
+block_end:
+
+	Block &block = blocks[start];
+	if (instrs.empty())
+	{
+		block = Block{ nullptr, static_cast<uint32_t>(start + 1) };
+		add_to_pages(start, start + 1);
+		return;
+	}
+
+	if (arena_used + MAX_BLOCK_SIZE > ARENA_SIZE)
+		flush();
+
+	uint8_t *entry = arena + arena_used;
+	out = entry;
+
+	std::vector<Bail> bails;
+
+	emit8(0x48); emit8(0x8B); emit8(0x37);				// mov rsi, [rdi]
+	emit8(0x4C); emit8(0x8B); emit8(0x47); emit8(JIT_STATE_DS_SIZE);	// mov r8, [rdi + ds_size]
+
+	if (need > 0)
+	{
+		emit8(0x49); emit8(0x81); emit8(0xF8); emit32(need);	// cmp r8, need
+		bails.push_back(Bail{ emit_jcc(JB), start, 0, 0 });
+	}
+	if (grow > 0)
+	{
+		emit8(0x49); emit8(0x81); emit8(0xF8); emit32(ds_max - grow);	// cmp r8, ds_max - grow
+		bails.push_back(Bail{ emit_jcc(JA), start, 0, 0 });
+	}
+
+	emit8(0x4A); emit8(0x8D); emit8(0x14); emit8(0x86);	// lea rdx, [rsi + r8 * 4]
+	emit_ds_access(0x8B, MODRM_EAX_RDX_DISP32, -1);		// mov eax, [rdx - 4]
+	emit8(0x49); emit8(0xBB); emit64(reinterpret_cast<uintptr_t>(PM));	// mov r11, PM
+
+	// Bails before instrs[executed] is done, with its operands still on DS
+	int d = 0;
+	uint32_t executed = 0;
+	auto bail_here = [&](const uint8_t condition)
+	{
+		bails.push_back(Bail{ emit_jcc(condition), instrs[executed].ip, d, executed });
+	};
+
+	for (; executed < instrs.size(); executed++)
+	{
+		const Instr &instr = instrs[executed];
+
+		switch (instr.op)
+		{
+		case Emulator::NOP:
+			break;
+		case Emulator::PUSH:
+			emit_ds_access(0x89, MODRM_EAX_RDX_DISP32, d - 1);	// mov [DS top slot], eax
+			emit8(0xB8); emit32(instr.imm);					// mov eax, imm
+			d++;
+			break;
+		case Emulator::ADD:
+			emit_ds_access(0x03, MODRM_EAX_RDX_DISP32, d-- - 2);	// add eax, X
+			break;
+		case Emulator::SUB:
+			emit_ds_access(0x8B, MODRM_ECX_RDX_DISP32, d-- - 2);	// mov ecx, X
+			emit8(0x29); emit8(0xC1);						// sub ecx, eax
+			emit8(0x89); emit8(0xC8);						// mov eax, ecx
+			break;
+		case Emulator::AND:
+			emit_ds_access(0x23, MODRM_EAX_RDX_DISP32, d-- - 2);	// and eax, X
+			break;
+		case Emulator::OR:
+			emit_ds_access(0x0B, MODRM_EAX_RDX_DISP32, d-- - 2);	// or eax, X
+			break;
+		case Emulator::XOR:
+			emit_ds_access(0x33, MODRM_EAX_RDX_DISP32, d-- - 2);	// xor eax, X
+			break;
+		case Emulator::SHL:
+		case Emulator::SHR:
+			emit8(0x89); emit8(0xC1);						// mov ecx, eax
+			emit_ds_access(0x8B, MODRM_EAX_RDX_DISP32, d-- - 2);	// mov eax, X
+			emit8(0xD3); emit8(instr.op == Emulator::SHL ? 0xE0 : 0xF8);	// shl/sar eax, cl
+			break;
+		case Emulator::NEG:
+			emit8(0xF7); emit8(0xD8);						// neg eax
+			break;
+		case Emulator::NOT:
+			emit8(0xF7); emit8(0xD0);						// not eax
+			break;
+		case Emulator::RM:
+			emit_ds_access(0x8B, MODRM_EAX_RDX_DISP32, d-- - 2);	// mov eax, new DS top
+			break;
+		case Emulator::PUSHIP:
+			emit8(0x89); emit8(0xC1);						// mov ecx, eax
+			emit8(0x81); emit8(0xF9); emit32(PM_size - 1);	// cmp ecx, PM_size - 1
+			bail_here(JA);
+			emit8(0x4C); emit8(0x8B); emit8(0x4F); emit8(JIT_STATE_IS_SIZE);	// mov r9, [rdi + is_size]
+			emit8(0x49); emit8(0x81); emit8(0xF9); emit32(is_max);	// cmp r9, is_max
+			bail_here(JAE);
+			emit8(0x4C); emit8(0x8B); emit8(0x57); emit8(JIT_STATE_IS);	// mov r10, [rdi + is]
+			emit8(0x4B); emit8(0x89); emit8(0x0C); emit8(0xCA);	// mov [r10 + r9 * 8], rcx
+			emit8(0x49); emit8(0xFF); emit8(0xC1);			// inc r9
+			emit8(0x4C); emit8(0x89); emit8(0x4F); emit8(JIT_STATE_IS_SIZE);	// mov [rdi + is_size], r9
+			emit_ds_access(0x8B, MODRM_EAX_RDX_DISP32, d-- - 2);	// mov eax, new DS top
+			break;
+		case Emulator::RMIP:
+			emit8(0x4C); emit8(0x8B); emit8(0x4F); emit8(JIT_STATE_IS_SIZE);	// mov r9, [rdi + is_size]
+			emit8(0x4D); emit8(0x85); emit8(0xC9);			// test r9, r9
+			bail_here(JZ);
+			emit8(0x49); emit8(0xFF); emit8(0xC9);			// dec r9
+			emit8(0x4C); emit8(0x89); emit8(0x4F); emit8(JIT_STATE_IS_SIZE);	// mov [rdi + is_size], r9
+			break;
+		case Emulator::PUSHPM:
+			emit8(0x3D); emit32(PM_size - sizeof(int32_t));	// cmp eax, PM_size - 4
+			bail_here(JA);
+			emit8(0x41); emit8(0x8B); emit8(0x04); emit8(0x03);	// mov eax, [r11 + rax]
+			emit8(0x0F); emit8(0xC8);						// bswap eax
+			break;
+		case Emulator::POPPM:
+			// Writes into video memory or compiled code are interpreted
+			emit_ds_access(0x8B, MODRM_ECX_RDX_DISP32, d - 2);	// mov ecx, X
+			emit8(0x81); emit8(0xF9); emit32(write_limit - sizeof(int32_t));	// cmp ecx, write_limit - 4
+			bail_here(JA);
+			emit8(0x49); emit8(0xBA); emit64(reinterpret_cast<uintptr_t>(code_cells.data()));	// mov r10, code_cells
+			emit8(0x41); emit8(0x83); emit8(0x3C); emit8(0x0A); emit8(0x00);	// cmp dword [r10 + rcx], 0
+			bail_here(JNZ);
+			emit8(0x0F); emit8(0xC8);						// bswap eax
+			emit8(0x41); emit8(0x89); emit8(0x04); emit8(0x0B);	// mov [r11 + rcx], eax
+			d -= 2;
+			emit_ds_access(0x8B, MODRM_EAX_RDX_DISP32, d - 1);	// mov eax, new DS top
+			break;
+		case Emulator::JMP:
+		case Emulator::JZ:
+		case Emulator::JNZ:
+			// Out of bounds targets are left to the interpreter, so it can report the error
+			emit8(0x89); emit8(0xC1);						// mov ecx, eax
+			emit8(0x81); emit8(0xF9); emit32(PM_size - 1);	// cmp ecx, PM_size - 1
+			bail_here(JA);
+			emit_set_executed(executed + 1);
+
+			if (instr.op == Emulator::JMP)
+			{
+				emit_set_ds_size(d - 1);
+				emit8(0x89); emit8(0xC8);					// mov eax, ecx
+			}
+			else
+			{
+				emit_set_ds_size(d - 2);
+				emit8(0xB8); emit32(instr.ip + 1);			// mov eax, fallthrough
+				emit_ds_access(0x83, 0xBA, d - 2);			// cmp dword [X], 0
+				emit8(0x00);
+				emit8(0x0F); emit8(instr.op == Emulator::JZ ? 0x44 : 0x45);	// cmovz/cmovnz eax, ecx
+				emit8(0xC1);
+			}
+			emit8(0xC3);									// ret
+			break;
+		case Emulator::POPIP:
+			// Returns to the emulator, which looks the target up in the block cache
+			emit8(0x4C); emit8(0x8B); emit8(0x4F); emit8(JIT_STATE_IS_SIZE);	// mov r9, [rdi + is_size]
+			emit8(0x4D); emit8(0x85); emit8(0xC9);			// test r9, r9
+			bail_here(JZ);
+			emit8(0x49); emit8(0xFF); emit8(0xC9);			// dec r9
+			emit8(0x4C); emit8(0x8B); emit8(0x57); emit8(JIT_STATE_IS);	// mov r10, [rdi + is]
+			emit8(0x4B); emit8(0x8B); emit8(0x0C); emit8(0xCA);	// mov rcx, [r10 + r9 * 8]
+			emit8(0x48); emit8(0x81); emit8(0xF9); emit32(PM_size - 1);	// cmp rcx, PM_size - 1
+			bail_here(JA);
+			emit8(0x4C); emit8(0x89); emit8(0x4F); emit8(JIT_STATE_IS_SIZE);	// mov [rdi + is_size], r9
+			emit_ds_access(0x89, MODRM_EAX_RDX_DISP32, d - 1);
+			emit_set_ds_size(d);
+			emit_set_executed(executed + 1);
+			emit8(0x89); emit8(0xC8);						// mov eax, ecx
+			emit8(0xC3);									// ret
+			break;
+		}
+	}
+
+	if (!terminated)
+	{
+		emit_ds_access(0x89, MODRM_EAX_RDX_DISP32, d - 1);
+		emit_set_ds_size(d);
+		emit_set_executed(executed);
+		emit_return(ip, false);
+	}
+
+	for (const Bail &bail : bails)
+	{
+		patch_jcc(bail.position);
+		if (bail.executed > 0 || bail.depth != 0) // Entry bails have not touched anything yet
+		{
+			emit_ds_access(0x89, MODRM_EAX_RDX_DISP32, bail.depth - 1);
+			emit_set_ds_size(bail.depth);
+		}
+		emit_set_executed(bail.executed);
+		emit_return(bail.ip, true);
+	}
+
+	arena_used = out - arena;
+
+	block = Block{ reinterpret_cast<BlockCode>(entry), static_cast<uint32_t>(ip) };
+	add_to_pages(start, ip);
+}
+
+void Jit::reset(uint8_t *PM)
+{
+	this->PM = PM;
+	flush();
+}
+
+void Jit::flush()
+{
+	arena_used = 0;
+
+	for (auto &block : blocks)
+		block = Block{ nullptr, 0 };
+	for (auto &starts : page_blocks)
+		starts.clear();
+	std::fill(code_cells.begin(), code_cells.end(), 0);
+}
+
+void Jit::add_to_pages(const size_t start, const size_t end)
+{
+	for (size_t page = start >> PAGE_SHIFT; page <= (end - 1) >> PAGE_SHIFT; page++)
+		page_blocks[page].push_back(start);
+
+	std::fill(code_cells.begin() + start, code_cells.begin() + end, 1);
+}
+
+void Jit::emit8(const uint8_t byte)
+{
+	*out++ = byte;
+}
+
+void Jit::emit32(const uint32_t dword)
+{
+	std::memcpy(out, &dword, sizeof(uint32_t));
+	out += sizeof(uint32_t);
+}
+
+void Jit::emit64(const uint64_t qword)
+{
+	std::memcpy(out, &qword, sizeof(uint64_t));
+	out += sizeof(uint64_t);
+}
+
+void Jit::emit_ds_access(const uint8_t opcode, const uint8_t modrm, const int depth)
+{
+	emit8(opcode);
+	emit8(modrm);
+	emit32(depth * static_cast<int>(sizeof(int32_t)));
+}
+
+void Jit::emit_set_ds_size(const int depth)
+{
+	emit8(0x4D); emit8(0x89); emit8(0xC1);					// mov r9, r8
+	emit8(0x49); emit8(0x81); emit8(0xC1); emit32(depth);		// add r9, depth
+	emit8(0x4C); emit8(0x89); emit8(0x4F); emit8(JIT_STATE_DS_SIZE);	// mov [rdi + ds_size], r9
+}
+
+void Jit::emit_set_executed(const uint32_t executed)
+{
+	emit8(0x48); emit8(0xC7); emit8(0x47); emit8(JIT_STATE_EXECUTED);	// mov qword [rdi + executed], imm
+	emit32(executed);
+}
+
+size_t Jit::emit_jcc(const uint8_t condition)
+{
+	emit8(0x0F);
+	emit8(condition);
+	emit32(0);
+
+	return out - arena;
+}
+
+void Jit::patch_jcc(const size_t position)
+{
+	const int32_t rel = static_cast<int32_t>((out - arena) - position);
+	std::memcpy(arena + position - sizeof(int32_t), &rel, sizeof(int32_t));
+}
+
+void Jit::emit_return(const size_t ip, const bool interpret)
+{
+	if (interpret)
+	{
+		emit8(0x48); emit8(0xC7); emit8(0x47); emit8(JIT_STATE_INTERPRET);	// mov qword [rdi + interpret], 1
+		emit32(1);
+	}
+
+	emit8(0xB8); emit32(ip);									// mov eax, ip
+	emit8(0xC3);												// ret
+}
+
+void Jit::error(const std::string msg) const
+{
+	throw std::runtime_error("ERROR: " + msg);
+}
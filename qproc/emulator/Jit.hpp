@@ -0,0 +1,99 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/*
+ * Machine state shared between the emulator and compiled blocks.
+ * DS[0 .. ds_size - 1] are all in memory while no block is running.
+ */
+struct JitState
+{
+	int32_t *ds;
+	size_t ds_size;
+	size_t interpret; // Set by a block when the instruction at the returned IP should be interpreted
+	size_t executed; // Number of QProc instructions the block has executed
+	size_t *is;
+	size_t is_size;
+};
+
+/*
+ * Translates QProc basic blocks into x86-64 code. A block is a run of
+ * instructions ended by JMP/JZ/JNZ/POPIP or by an instruction the JIT leaves
+ * to the interpreter (INPUT, PEEK, HALT, ...). Inside a block the DS top lives
+ * in EAX, and the DS depth checks are done once at block entry.
+ *
+ * Whenever a compiled instruction would fail or needs the interpreter's help
+ * (an out of bounds jump, a POPPM into code or video memory), the block
+ * returns with the state as it was before that instruction and asks for it
+ * to be interpreted.
+ */
+class Jit
+{
+public:
+	typedef size_t (*BlockCode)(JitState *state);
+
+	struct Block
+	{
+		BlockCode code; // nullptr - the instruction at this address must be interpreted
+		uint32_t end; // First PM cell after the block, 0 - not compiled yet
+	};
+
+	Jit(uint8_t *PM, const size_t PM_size, const size_t write_limit,
+		const size_t ds_max, const size_t is_max);
+	~Jit();
+
+	static bool is_supported();
+
+	void reset(uint8_t *PM); // Drops all blocks, PM may have moved
+	const Block &get_block(const size_t ip);
+	void invalidate(const size_t beginning, const size_t end);
+
+private:
+	struct Bail
+	{
+		size_t position; // Jump to patch
+		size_t ip;
+		int depth;
+		uint32_t executed;
+	};
+
+	void compile(const size_t start);
+	void flush();
+	void add_to_pages(const size_t start, const size_t end);
+
+	void emit8(const uint8_t byte);
+	void emit32(const uint32_t dword);
+	void emit64(const uint64_t qword);
+	void emit_ds_access(const uint8_t opcode, const uint8_t modrm, const int depth);
+	void emit_set_ds_size(const int depth);
+	void emit_set_executed(const uint32_t executed);
+	size_t emit_jcc(const uint8_t condition);
+	void patch_jcc(const size_t position);
+	void emit_return(const size_t ip, const bool interpret);
+
+	void error(const std::string msg) const;
+
+	static const size_t ARENA_SIZE = 16 * 1024 * 1024;
+	static const size_t MAX_BLOCK_SIZE = 16384; // Bytes of generated code
+	static const size_t MAX_BLOCK_INSTRS = 128;
+	static const size_t PAGE_SHIFT = 8; // Granularity of block invalidation
+
+	uint8_t *PM;
+	const size_t PM_size;
+	const size_t write_limit; // POPPM at or above this address is always interpreted
+	const size_t ds_max, is_max;
+
+	uint8_t *arena = nullptr;
+	size_t arena_used = 0;
+	uint8_t *out = nullptr; // Current emission point
+
+	std::vector<Block> blocks; // Indexed by the block's first PM cell
+	std::vector<std::vector<uint32_t>> page_blocks; // Blocks overlapping each PM page
+	std::vector<uint8_t> code_cells; // 1 for every PM cell covered by a block, read by compiled POPPM
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <utility>
+
+namespace
+{
+	const char *const OPCODE_NAMES[] =
+	{
+		"NOP", "ADD", "SUB", "NEG", "SHL", "SHR", "AND", "OR",
+		"XOR", "NOT", "JMP", "JZ", "JNZ", "PUSH", "RM", "PUSHIP",
+		"POPIP", "RMIP", "PUSHPM", "POPPM", "INPUT", "PEEK", "HALT", "PUSH8",
+		"PUSH16", "JMPREL8", "JMPREL16", "JZREL8", "JNZREL8", "JZREL16", "JNZREL16", "CALLREL16"
+	};
+	const size_t OPCODES_NUM = sizeof(OPCODE_NAMES) / sizeof(OPCODE_NAMES[0]);
+
+	const size_t TOP_BLOCKS = 20, TOP_PROCEDURES = 20, TOP_INSTRS = 20;
+
+	double percent(const uint64_t part, const uint64_t total)
+	{
+		return total != 0 ? 100.0 * part / total : 0;
+	}
+}
+
+Profiler::Profiler(const size_t PM_size) :
+	PM_size(PM_size), addr_counts(PM_size), leaders(PM_size)
+{
+	reset();
+}
+
+void Profiler::reset()
+{
+	std::fill(addr_counts.begin(), addr_counts.end(), 0);
+	std::fill(leaders.begin(), leaders.end(), 0);
+	std::fill(op_counts, op_counts + 256, 0);
+	instrs = 0;
+	max_ds = max_is = 0;
+
+	prev_ip = 0;
+	prev_op = Emulator::JMP; // Makes address 0 a block leader
+	call_pending = false;
+
+	frames.clear();
+	procedures.clear();
+	symbols.clear();
+}
+
+void Profiler::load_symbols(const std::string filename)
+{
+	std::ifstream file(filename);
+
+	uint32_t address;
+	std::string label;
+	while (file >> address >> label)
+		symbols[address] = label;
+}
+
+void Profiler::leave_procedure()
+{
+	const Frame frame = frames.back();
+	frames.pop_back();
+
+	// A recursive procedure counts the instructions of its inner calls again
+	procedures[frame.entry].instrs += instrs - frame.start;
+}
+
+std::string Profiler::symbolize(const size_t address) const
+{
+	auto it = symbols.upper_bound(address);
+	if (it == symbols.begin())
+		return "";
+
+	--it;
+	if (it->first == address)
+		return it->second;
+	return it->second + "+" + std::to_string(address - it->first);
+}
+
+void Profiler::write_report(const std::string filename, const uint8_t *PM) const
+{
+	std::ofstream out(filename, std::ios::trunc);
+	if (!out.is_open())
+		throw std::runtime_error("ERROR: Could not open the profile report file");
+
+	out << "QProc profile" << std::endl << std::endl;
+	out << "Instructions executed: " << instrs << std::endl;
+	out << "Maximum DS depth: " << max_ds << ", maximum IS depth: " << max_is << std::endl;
+	out << std::fixed << std::setprecision(2);
+
+	out << std::endl << "Opcodes:" << std::endl;
+	std::vector<std::pair<uint64_t, size_t>> ops;
+	for (size_t op = 0; op < 256; op++)
+		if (op_counts[op] != 0)
+			ops.emplace_back(op_counts[op], op);
+	std::sort(ops.rbegin(), ops.rend());
+	for (const auto &op : ops)
+		out << "  " << std::setw(10) << std::left << (op.second < OPCODES_NUM ? OPCODE_NAMES[op.second] : "?") <<
+			std::right << std::setw(14) << op.first << std::setw(8) << percent(op.first, instrs) << "%" << std::endl;
+
+	// Basic blocks: runs of executed instructions between leaders
+	struct BlockInfo
+	{
+		size_t start;
+		uint64_t entries; // Executions of the first instruction
+		uint64_t instrs;
+	};
+	std::vector<BlockInfo> blocks;
+	size_t next = PM_size; // Address right after the last executed instruction
+	for (size_t address = 0; address < PM_size; address++)
+	{
+		if (addr_counts[address] == 0)
+			continue;
+
+		if (blocks.empty() || leaders[address] || address != next)
+			blocks.push_back(BlockInfo{ address, addr_counts[address], 0 });
+		blocks.back().instrs += addr_counts[address];
+		next = address + instr_length(PM[address]);
+	}
+	std::sort(blocks.begin(), blocks.end(),
+		[](const BlockInfo &a, const BlockInfo &b) { return a.instrs > b.instrs; });
+
+	out << std::endl << "Hottest basic blocks:" << std::endl;
+	out << "  " << std::setw(8) << "Address" << std::setw(14) << "Entries" << std::setw(14) <<
+		"Instructions" << std::setw(9) << "Share" << "  Label" << std::endl;
+	for (size_t i = 0; i < blocks.size() && i < TOP_BLOCKS; i++)
+		out << "  " << std::setw(8) << blocks[i].start << std::setw(14) << blocks[i].entries <<
+			std::setw(14) << blocks[i].instrs << std::setw(8) << percent(blocks[i].instrs, instrs) << "%  " <<
+			symbolize(blocks[i].start) << std::endl;
+
+	// Calls still running at exit are closed at the current instruction count
+	std::map<uint32_t, Procedure> totals = procedures;
+	for (const auto &frame : frames)
+		totals[frame.entry].instrs += instrs - frame.start;
+
+	std::vector<std::pair<uint32_t, Procedure>> procs(totals.begin(), totals.end());
+	std::sort(procs.begin(), procs.end(),
+		[](const std::pair<uint32_t, Procedure> &a, const std::pair<uint32_t, Procedure> &b)
+		{ return a.second.instrs > b.second.instrs; });
+
+	out << std::endl << "Procedures (instructions include callees):" << std::endl;
+	out << "  " << std::setw(8) << "Entry" << std::setw(14) << "Calls" << std::setw(14) <<
+		"Instructions" << std::setw(9) << "Share" << "  Label" << std::endl;
+	for (size_t i = 0; i < procs.size() && i < TOP_PROCEDURES; i++)
+		out << "  " << std::setw(8) << procs[i].first << std::setw(14) << procs[i].second.calls <<
+			std::setw(14) << procs[i].second.instrs << std::setw(8) << percent(procs[i].second.instrs, instrs) <<
+			"%  " << symbolize(procs[i].first) << std::endl;
+
+	std::vector<std::pair<uint64_t, size_t>> hot;
+	for (size_t address = 0; address < PM_size; address++)
+		if (addr_counts[address] != 0)
+			hot.emplace_back(addr_counts[address], address);
+	const size_t shown = std::min(hot.size(), TOP_INSTRS);
+	std::partial_sort(hot.begin(), hot.begin() + shown, hot.end(),
+		[](const std::pair<uint64_t, size_t> &a, const std::pair<uint64_t, size_t> &b) { return a.first > b.first; });
+
+	out << std::endl << "Hottest instructions:" << std::endl;
+	for (size_t i = 0; i < shown; i++)
+	{
+		const uint8_t op = PM[hot[i].second];
+		out << "  " << std::setw(8) << hot[i].second << "  " << std::setw(10) << std::left <<
+			(op < OPCODES_NUM ? OPCODE_NAMES[op] : "?") << std::right << std::setw(14) << hot[i].first <<
+			"  " << symbolize(hot[i].second) << std::endl;
+	}
+}
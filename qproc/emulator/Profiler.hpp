@@ -0,0 +1,111 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "Emulator.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Collects an instruction-level profile of a QProc program. step() is called
+ * by the profiling instantiation of the switch interpreter before every
+ * instruction; the regular engines never see a profiler.
+ *
+ * Calls are recognized by the sequence the Assembler emits for CALL:
+ * a PUSHIP followed by a taken JMP. POPIP returns from the innermost call.
+ */
+class Profiler
+{
+public:
+	Profiler(const size_t PM_size);
+
+	void reset();
+	void load_symbols(const std::string filename); // "address label" lines, a missing file is not an error
+
+	void step(const size_t ip, const uint8_t op, const size_t ds_size, const size_t is_size)
+	{
+		if (ip != prev_ip + instr_length(prev_op) || is_control_transfer(prev_op))
+		{
+			leaders[ip] = 1;
+
+			if ((prev_op == Emulator::JMP && call_pending) || prev_op == Emulator::CALLREL16)
+			{
+				procedures[ip].calls++;
+				frames.push_back(Frame{ static_cast<uint32_t>(ip), instrs });
+			}
+			else if (prev_op == Emulator::POPIP && !frames.empty())
+				leave_procedure();
+		}
+		else if (prev_op == Emulator::RMIP && !frames.empty()) // The return address was dropped
+			leave_procedure();
+		call_pending = prev_op == Emulator::PUSHIP || (call_pending && !is_control_transfer(prev_op));
+
+		addr_counts[ip]++;
+		op_counts[op]++;
+		instrs++;
+
+		if (ds_size > max_ds)
+			max_ds = ds_size;
+		if (is_size > max_is)
+			max_is = is_size;
+
+		prev_ip = ip;
+		prev_op = op;
+	}
+
+	void write_report(const std::string filename, const uint8_t *PM) const;
+
+private:
+	struct Frame
+	{
+		uint32_t entry;
+		uint64_t start; // instrs at the call
+	};
+
+	struct Procedure
+	{
+		uint64_t calls = 0;
+		uint64_t instrs = 0; // Including the procedures it calls
+	};
+
+	static size_t instr_length(const uint8_t op)
+	{
+		if (op == Emulator::PUSH)
+			return 1 + sizeof(int32_t);
+		if (op == Emulator::PUSH8 || op == Emulator::JMPREL8 || op == Emulator::JZREL8 || op == Emulator::JNZREL8)
+			return 2;
+		if (op == Emulator::PUSH16 || (op >= Emulator::JMPREL16 && op <= Emulator::CALLREL16))
+			return 3;
+		return 1;
+	}
+	static bool is_control_transfer(const uint8_t op)
+	{
+		return op == Emulator::JMP || op == Emulator::JZ || op == Emulator::JNZ || op == Emulator::POPIP ||
+			(op >= Emulator::JMPREL8 && op <= Emulator::CALLREL16);
+	}
+
+	void leave_procedure();
+	std::string symbolize(const size_t address) const;
+
+	const size_t PM_size;
+
+	std::vector<uint64_t> addr_counts;
+	std::vector<uint8_t> leaders; // 1 - a basic block starts at this address
+	uint64_t op_counts[256];
+	uint64_t instrs;
+	size_t max_ds, max_is;
+
+	size_t prev_ip;
+	uint8_t prev_op;
+	bool call_pending; // PUSHIP seen, no control transfer since
+
+	std::vector<Frame> frames;
+	std::map<uint32_t, Procedure> procedures; // By entry address
+
+	std::map<uint32_t, std::string> symbols;
+};
+
+#endif
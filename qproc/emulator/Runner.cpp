@@ -0,0 +1,137 @@
+#include "Runner.hpp"
+
+#include "IOChannel.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+Runner::Runner(const EmulatorSettings settings, const size_t threads_num) :
+	settings(settings),
+	threads_num(threads_num != 0 ? threads_num : std::max(1u, std::thread::hardware_concurrency())),
+	queues(this->threads_num)
+{
+	// Instances run concurrently, so there is no window and no shared console output
+	this->settings.headless = true;
+	this->settings.quiet = true;
+	this->settings.io = nullptr;
+	this->settings.snapshot_async = false; // fork() does not mix with other running threads
+}
+
+std::vector<RunnerResult> Runner::run(const std::vector<RunnerJob> &jobs)
+{
+	std::vector<RunnerResult> results(jobs.size());
+
+	for (size_t job = 0; job < jobs.size(); job++)
+		queues[job % threads_num].jobs.push_back(job);
+
+	const auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for (size_t thread_num = 0; thread_num < threads_num; thread_num++)
+		threads.emplace_back(&Runner::work, this, thread_num, std::cref(jobs), std::ref(results));
+	for (auto &thread : threads)
+		thread.join();
+
+	stats = RunnerStats();
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	stats.threads = threads_num;
+	for (const auto &result : results)
+		stats.instrs += result.instrs;
+
+	return results;
+}
+
+void Runner::work(const size_t thread_num, const std::vector<RunnerJob> &jobs,
+	std::vector<RunnerResult> &results)
+{
+	std::ostringstream output; // Outlives the emulator, which keeps writing into it
+	std::unique_ptr<Emulator> emulator;
+	std::string init_error;
+
+	try
+	{
+		emulator.reset(new Emulator(settings));
+	}
+	catch (const std::exception &ex)
+	{
+		init_error = ex.what();
+	}
+
+	size_t job;
+	while (take_job(thread_num, job))
+	{
+		RunnerResult &result = results[job];
+		if (!emulator)
+		{
+			result.error = init_error;
+			continue;
+		}
+
+		const RunnerJob &params = jobs[job];
+		const auto start = std::chrono::steady_clock::now();
+
+		try
+		{
+			emulator->set_io(std::make_shared<BufferIOChannel>(params.input, output));
+			if (!params.dump_path.empty())
+				emulator->set_dump_path(params.dump_path);
+			else if (!settings.dump_path.empty())
+				emulator->set_dump_path(settings.dump_path + "_" + std::to_string(job));
+			if (!settings.profile_path.empty())
+				emulator->set_profile_path(settings.profile_path + "_" + std::to_string(job));
+			if (!settings.snapshot_path.empty())
+				emulator->set_snapshot_path(settings.snapshot_path + "_" + std::to_string(job));
+
+			emulator->load(params.rom);
+			emulator->run();
+			result.ok = true;
+		}
+		catch (const EmulatorLimitError &ex)
+		{
+			result.error = ex.what();
+			result.limit_hit = true;
+		}
+		catch (const std::exception &ex)
+		{
+			result.error = ex.what();
+		}
+
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.instrs = emulator->get_instrs_executed();
+		result.output = output.str();
+		output.str("");
+	}
+}
+
+bool Runner::take_job(const size_t thread_num, size_t &job)
+{
+	{
+		WorkQueue &own = queues[thread_num];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.jobs.empty())
+		{
+			job = own.jobs.front();
+			own.jobs.pop_front();
+			return true;
+		}
+	}
+
+	// Steal from the back, away from the victim's own end
+	for (size_t i = 1; i < threads_num; i++)
+	{
+		WorkQueue &victim = queues[(thread_num + i) % threads_num];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.jobs.empty())
+		{
+			job = victim.jobs.back();
+			victim.jobs.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,73 @@
+#ifndef RUNNER_HPP
+#define RUNNER_HPP
+
+#include "Emulator.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct RunnerJob
+{
+	std::string rom;
+	std::string input; // INPUT values, read as if from a file
+	std::string dump_path; // Video memory dump, empty - settings.dump_path with the job number
+};
+
+struct RunnerResult
+{
+	bool ok = false;
+	std::string output; // Everything the ROM PEEKed
+	std::string error; // Empty when ok
+	bool limit_hit = false; // Stopped by the instruction budget, the watchdog or as an infinite loop
+	uint64_t instrs = 0;
+	double seconds = 0;
+};
+
+struct RunnerStats
+{
+	uint64_t instrs = 0; // Over all jobs
+	double seconds = 0; // Wall time of the whole run
+	size_t threads = 0;
+
+	double ips() const { return seconds > 0 ? instrs / seconds : 0; }
+};
+
+/*
+ * Runs independent ROM instances on a pool of threads. Every thread owns a
+ * headless Emulator reused across its jobs, so the stacks and engine caches
+ * are allocated once per thread. Jobs are dealt round-robin into per-thread
+ * queues; a thread that runs out of work steals from the back of the others.
+ * ROM images are mapped copy-on-write, so instances of the same file share
+ * the pages they do not write to.
+ */
+class Runner
+{
+public:
+	Runner(const EmulatorSettings settings, const size_t threads_num = 0); // 0 - one per core
+
+	std::vector<RunnerResult> run(const std::vector<RunnerJob> &jobs);
+	const RunnerStats &get_stats() const { return stats; }
+
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<size_t> jobs;
+	};
+
+	void work(const size_t thread_num, const std::vector<RunnerJob> &jobs,
+		std::vector<RunnerResult> &results);
+	bool take_job(const size_t thread_num, size_t &job);
+
+	EmulatorSettings settings;
+	size_t threads_num;
+
+	std::vector<WorkQueue> queues;
+	RunnerStats stats;
+};
+
+#endif
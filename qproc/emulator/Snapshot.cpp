@@ -0,0 +1,203 @@
+#include "Snapshot.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace
+{
+	const char MAGIC[4] = { 'Q', 'P', 'S', 'N' };
+
+	void put32(std::vector<uint8_t> &out, const uint32_t value)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(static_cast<uint8_t>(value >> shift));
+	}
+
+	void put64(std::vector<uint8_t> &out, const uint64_t value)
+	{
+		put32(out, static_cast<uint32_t>(value >> 32));
+		put32(out, static_cast<uint32_t>(value));
+	}
+
+	class Reader
+	{
+	public:
+		Reader(const std::vector<uint8_t> &data) : data(data) {}
+
+		bool has(const size_t size) const { return data.size() - pos >= size; }
+
+		uint8_t get8() { return data[pos++]; }
+
+		uint32_t get32()
+		{
+			uint32_t value = 0;
+			for (int i = 0; i < 4; i++)
+				value = (value << 8) | data[pos++];
+			return value;
+		}
+
+		uint64_t get64()
+		{
+			const uint64_t high = get32();
+			return (high << 32) | get32();
+		}
+
+		const uint8_t *take(const size_t size)
+		{
+			const uint8_t *ptr = &data[pos];
+			pos += size;
+			return ptr;
+		}
+
+	private:
+		const std::vector<uint8_t> &data;
+		size_t pos = 0;
+	};
+}
+
+void Snapshot::save(const std::string filename, const SnapshotState &state,
+	const uint8_t *PM, const uint8_t *ROM, const size_t PM_size)
+{
+	std::vector<uint8_t> out(MAGIC, MAGIC + sizeof(MAGIC));
+	put32(out, VERSION);
+	put64(out, hash(ROM, PM_size));
+
+	put32(out, state.IP);
+	out.push_back(state.halt_called);
+	put64(out, state.instrs_executed);
+
+	put32(out, state.DS.size());
+	for (const int32_t cell : state.DS)
+		put32(out, cell);
+	put32(out, state.IS.size());
+	for (const size_t cell : state.IS)
+		put32(out, cell);
+
+	const size_t runs_num_pos = out.size();
+	put32(out, 0);
+	uint32_t runs_num = 0;
+
+	for (size_t cell = 0; cell < PM_size;)
+	{
+		if (PM[cell] == ROM[cell])
+		{
+			cell++;
+			continue;
+		}
+
+		// Extend the run over changed cells and unchanged gaps shorter than MIN_GAP
+		size_t end = cell + 1, last_changed = cell;
+		for (; end < PM_size && end - last_changed <= MIN_GAP; end++)
+			if (PM[end] != ROM[end])
+				last_changed = end;
+		end = last_changed + 1;
+
+		put32(out, cell);
+		put32(out, end - cell);
+		out.insert(out.end(), PM + cell, PM + end);
+		runs_num++;
+
+		cell = end;
+	}
+
+	for (int i = 0; i < 4; i++)
+		out[runs_num_pos + i] = static_cast<uint8_t>(runs_num >> (24 - 8 * i));
+
+	// Written aside and renamed, so an interrupted save never leaves a broken snapshot behind
+	const std::string tmp_filename = filename + ".tmp";
+	{
+		std::ofstream file(tmp_filename, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			error("Could not open the snapshot file");
+		if (!file.write(reinterpret_cast<const char*>(out.data()), out.size()))
+			error("Could not write the snapshot file");
+	}
+
+	if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+		error("Could not replace the snapshot file");
+}
+
+SnapshotState Snapshot::restore(const std::string filename,
+	uint8_t *PM, const uint8_t *ROM, const size_t PM_size,
+	const size_t DS_max_depth, const size_t IS_max_depth)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		error("Could not open the snapshot file");
+	const std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	Reader in(data);
+	if (!in.has(sizeof(MAGIC) + 4 + 8) || std::memcmp(in.take(sizeof(MAGIC)), MAGIC, sizeof(MAGIC)) != 0)
+		error("Not a QProc snapshot");
+	if (in.get32() != VERSION)
+		error("Unsupported snapshot version");
+	if (in.get64() != hash(ROM, PM_size))
+		error("The snapshot was taken with a different ROM");
+
+	SnapshotState state;
+
+	if (!in.has(4 + 1 + 8 + 4))
+		error("Corrupt snapshot");
+	state.IP = in.get32();
+	state.halt_called = in.get8() != 0;
+	state.instrs_executed = in.get64();
+
+	const uint32_t DS_size = in.get32();
+	if (state.IP > PM_size || DS_size > DS_max_depth)
+		error("The snapshot does not fit this emulator's limits");
+	if (!in.has(static_cast<uint64_t>(DS_size) * 4 + 4))
+		error("Corrupt snapshot");
+	for (uint32_t i = 0; i < DS_size; i++)
+		state.DS.push_back(static_cast<int32_t>(in.get32()));
+
+	const uint32_t IS_size = in.get32();
+	if (IS_size > IS_max_depth)
+		error("The snapshot does not fit this emulator's limits");
+	if (!in.has(static_cast<uint64_t>(IS_size) * 4 + 4))
+		error("Corrupt snapshot");
+	for (uint32_t i = 0; i < IS_size; i++)
+		state.IS.push_back(in.get32());
+
+	// Every run is checked before PM is touched, a corrupt snapshot leaves it as it was
+	struct Run
+	{
+		uint32_t offset, length;
+		const uint8_t *bytes;
+	};
+	std::vector<Run> runs;
+
+	const uint32_t runs_num = in.get32();
+	for (uint32_t run = 0; run < runs_num; run++)
+	{
+		if (!in.has(8))
+			error("Corrupt snapshot");
+		const uint32_t offset = in.get32(), length = in.get32();
+		if (offset > PM_size || length > PM_size - offset || !in.has(length))
+			error("Corrupt snapshot");
+
+		runs.push_back({ offset, length, in.take(length) });
+	}
+
+	std::memcpy(PM, ROM, PM_size);
+	for (const Run &run : runs)
+		std::memcpy(PM + run.offset, run.bytes, run.length);
+
+	return state;
+}
+
+uint64_t Snapshot::hash(const uint8_t *data, const size_t size)
+{
+	uint64_t result = 14695981039346656037ull; // FNV-1a
+	for (size_t i = 0; i < size; i++)
+		result = (result ^ data[i]) * 1099511628211ull;
+
+	return result;
+}
+
+void Snapshot::error(const std::string msg)
+{
+	throw std::runtime_error("ERROR: " + msg);
+}
@@ -0,0 +1,45 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct SnapshotState
+{
+	size_t IP = 0;
+	bool halt_called = false;
+	uint64_t instrs_executed = 0;
+	std::vector<int32_t> DS; // Bottom first
+	std::vector<size_t> IS; // Bottom first
+};
+
+/*
+ * Snapshot file, all numbers are big-endian:
+ * "QPSN", version, ROM hash, IP, halt flag, executed instruction count,
+ * DS size and cells, IS size and cells, then the runs of PM cells that
+ * differ from the ROM as (offset, length, bytes). Unchanged PM is not stored,
+ * so a snapshot can only be restored on top of the same ROM.
+ */
+class Snapshot
+{
+public:
+	// PM and ROM are PM_size cells each
+	static void save(const std::string filename, const SnapshotState &state,
+		const uint8_t *PM, const uint8_t *ROM, const size_t PM_size);
+	// Overwrites PM with the ROM plus the stored changes. The whole snapshot,
+	// IP and stack depths included, is checked first: on an error PM is untouched
+	static SnapshotState restore(const std::string filename,
+		uint8_t *PM, const uint8_t *ROM, const size_t PM_size,
+		const size_t DS_max_depth, const size_t IS_max_depth);
+
+private:
+	static uint64_t hash(const uint8_t *data, const size_t size);
+	static void error(const std::string msg);
+
+	static const uint32_t VERSION = 1;
+	static const size_t MIN_GAP = 8; // Shorter unchanged gaps are stored to save a run header
+};
+
+#endif
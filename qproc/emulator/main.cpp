@@ -1,25 +1,301 @@
 #include "Emulator.hpp"
+#include "IOChannel.hpp"
+#include "Runner.hpp"
 
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <limits>
+#include <sstream>
 #include <stdexcept>
+#include <vector>
+
+namespace
+{
+	const int EXIT_LIMIT = 2; // A ROM was stopped by the instruction budget, the watchdog or as an infinite loop
+
+	struct Options
+	{
+		EmulatorSettings settings;
+		std::vector<std::string> roms;
+		std::string input_path; // Empty - std::cin
+		std::string restore_path; // Snapshot to resume the ROM from
+		bool timing = false;
+		size_t threads = 1; // More than 1 - run the ROMs in parallel
+	};
+
+	struct Failures
+	{
+		size_t errors = 0;
+		size_t limits = 0; // ROMs stopped with an EmulatorLimitError
+
+		int exit_status() const { return errors != 0 ? EXIT_FAILURE : limits != 0 ? EXIT_LIMIT : EXIT_SUCCESS; }
+	};
+
+	void usage_error(const std::string msg)
+	{
+		throw std::runtime_error("ERROR: " + msg + "\n\n"
+			"Usage: emulator [options] ROM...\n"
+			"  --engine switch|threaded|predecoded|jit\n"
+			"  --headless           no video output window\n"
+			"  --input FILE         read INPUT values from FILE instead of stdin\n"
+			"                       (every ROM reads FILE from the start; with several threads\n"
+			"                       stdin is read up to its end first and every ROM gets all of it)\n"
+			"  --max-instrs N       stop a ROM after N instructions\n"
+			"  --max-seconds S      stop a ROM after S seconds\n"
+			"                       (exit status 2 for these and for detected infinite loops)\n"
+			"  --time               print instruction count and speed of every ROM\n"
+			"  --dump PATH          dump the video memory to PATH[_n]_halt.ppm\n"
+			"  --profile PATH       write a profile report to PATH[_n], labels come from ROM.sym\n"
+			"  --snapshot PATH      write machine state snapshots to PATH[_n]\n"
+			"  --snapshot-every N   take a snapshot every N instructions\n"
+			"  --restore FILE       resume the ROM from a snapshot\n"
+			"  --batch FILE         also run the ROMs listed in FILE, one per line\n"
+			"  --threads N          run the ROMs on N threads, 0 - one per core\n"
+			"  --quiet              do not print ROM sizes\n"
+			"Without arguments the ROM path is asked for interactively.");
+	}
+
+	double parse_seconds(const std::string str)
+	{
+		std::istringstream stream(str);
+		double seconds;
+		if (!(stream >> seconds) || !stream.eof() || seconds < 0)
+			usage_error("Expected a number of seconds, got '" + str + "'");
+
+		return seconds;
+	}
+
+	uint64_t parse_count(const std::string str)
+	{
+		if (str.empty() || str.size() > 18 || str.find_first_not_of("0123456789") != std::string::npos)
+			usage_error("Expected a number, got '" + str + "'");
+
+		return std::stoull(str);
+	}
+
+	Options parse_args(int argc, char *argv[])
+	{
+		Options options;
+
+		for (int i = 1; i < argc; i++)
+		{
+			const std::string arg = argv[i];
+			const bool has_value = i + 1 < argc;
+
+			if (arg == "--headless")
+				options.settings.headless = true;
+			else if (arg == "--time")
+				options.timing = true;
+			else if (arg == "--quiet")
+				options.settings.quiet = true;
+			else if (arg == "--engine" || arg == "--input" || arg == "--max-instrs" || arg == "--max-seconds" ||
+				arg == "--dump" || arg == "--profile" || arg == "--batch" || arg == "--threads" ||
+				arg == "--snapshot" || arg == "--snapshot-every" || arg == "--restore")
+			{
+				if (!has_value)
+					usage_error(arg + " needs a value");
+				const std::string value = argv[++i];
+
+				if (arg == "--engine")
+				{
+					if (value == "switch")
+						options.settings.engine = EmulatorEngine::Switch;
+					else if (value == "threaded")
+						options.settings.engine = EmulatorEngine::Threaded;
+					else if (value == "predecoded")
+						options.settings.engine = EmulatorEngine::Predecoded;
+					else if (value == "jit")
+						options.settings.engine = EmulatorEngine::Jit;
+					else
+						usage_error("Unknown engine '" + value + "'");
+				}
+				else if (arg == "--input")
+					options.input_path = value;
+				else if (arg == "--max-instrs")
+					options.settings.max_instrs = parse_count(value);
+				else if (arg == "--max-seconds")
+					options.settings.max_seconds = parse_seconds(value);
+				else if (arg == "--threads")
+					options.threads = parse_count(value);
+				else if (arg == "--dump")
+					options.settings.dump_path = value;
+				else if (arg == "--profile")
+					options.settings.profile_path = value;
+				else if (arg == "--snapshot")
+					options.settings.snapshot_path = value;
+				else if (arg == "--snapshot-every")
+					options.settings.snapshot_every = parse_count(value);
+				else if (arg == "--restore")
+					options.restore_path = value;
+				else
+				{
+					std::ifstream list(value);
+					if (!list.is_open())
+						usage_error("Could not open the batch file " + value);
+
+					std::string rom;
+					while (std::getline(list, rom))
+						if (!rom.empty())
+							options.roms.push_back(rom);
+				}
+			}
+			else if (arg.size() > 1 && arg[0] == '-')
+				usage_error("Unknown option " + arg);
+			else
+				options.roms.push_back(arg);
+		}
+
+		if (options.roms.empty())
+			usage_error("No ROMs given");
+		if (!options.restore_path.empty() && (options.roms.size() != 1 || options.threads != 1))
+			usage_error("--restore needs exactly one ROM and one thread");
+
+		return options;
+	}
+
+	// Runs all ROMs on one emulator
+	Failures run_roms(const Options &options)
+	{
+		Emulator emulator(options.settings);
+
+		std::string input;
+		if (!options.input_path.empty())
+			input = BufferIOChannel::read_file(options.input_path);
+
+		const bool batch = options.roms.size() > 1;
+		Failures failures;
+
+		for (size_t i = 0; i < options.roms.size(); i++)
+		{
+			const std::string &rom = options.roms[i];
+
+			if (!options.input_path.empty()) // Every ROM reads the input from the beginning
+				emulator.set_io(std::make_shared<BufferIOChannel>(input, std::cout));
+			if (batch && !options.settings.dump_path.empty())
+				emulator.set_dump_path(options.settings.dump_path + "_" + std::to_string(i));
+			if (batch && !options.settings.profile_path.empty())
+				emulator.set_profile_path(options.settings.profile_path + "_" + std::to_string(i));
+			if (batch && !options.settings.snapshot_path.empty())
+				emulator.set_snapshot_path(options.settings.snapshot_path + "_" + std::to_string(i));
+
+			const auto start = std::chrono::steady_clock::now();
+			try
+			{
+				emulator.load(rom);
+				if (!options.restore_path.empty())
+					emulator.restore_snapshot(options.restore_path);
+				emulator.run();
+			}
+			catch (const EmulatorLimitError &ex)
+			{
+				std::cerr << (batch ? rom + ": " : "") << ex.what() << std::endl;
+				failures.limits++;
+			}
+			catch (const std::runtime_error &ex)
+			{
+				std::cerr << (batch ? rom + ": " : "") << ex.what() << std::endl;
+				failures.errors++;
+			}
+			const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			if (options.timing)
+			{
+				const uint64_t instrs = emulator.get_instrs_executed();
+				std::cerr << rom << ": " << instrs << " instructions in " << elapsed.count() << " s (" <<
+					(elapsed.count() > 0 ? instrs / elapsed.count() / 1e6 : 0) << " MIPS)" << std::endl;
+			}
+		}
+
+		return failures;
+	}
+
+	// Runs all ROMs in parallel, their output is printed in order once all are done
+	Failures run_roms_parallel(const Options &options)
+	{
+		// Every job gets its own copy of the whole input, stdin is read up to its end first
+		std::string input;
+		if (!options.input_path.empty())
+			input = BufferIOChannel::read_file(options.input_path);
+		else
+		{
+			std::ostringstream contents;
+			contents << std::cin.rdbuf();
+			input = contents.str();
+		}
+
+		std::vector<RunnerJob> jobs(options.roms.size());
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			jobs[i].rom = options.roms[i];
+			jobs[i].input = input;
+		}
+
+		Runner runner(options.settings, options.threads);
+		const std::vector<RunnerResult> results = runner.run(jobs);
+
+		Failures failures;
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			std::cout << results[i].output << std::flush;
+			if (!results[i].ok)
+			{
+				std::cerr << jobs[i].rom << ": " << results[i].error << std::endl;
+				if (results[i].limit_hit)
+					failures.limits++;
+				else
+					failures.errors++;
+			}
+
+			if (options.timing)
+				std::cerr << jobs[i].rom << ": " << results[i].instrs << " instructions in " <<
+					results[i].seconds << " s" << std::endl;
+		}
+
+		if (options.timing)
+		{
+			const RunnerStats &stats = runner.get_stats();
+			std::cerr << "Total: " << stats.instrs << " instructions in " << stats.seconds << " s on " <<
+				stats.threads << " threads (" << stats.ips() / 1e6 << " MIPS)" << std::endl;
+		}
+
+		return failures;
+	}
+}
 
 int main(int argc, char *argv[])
 {
-    std::cout << std::endl << "QProc emulator" << std::endl <<
-        "Qwertygid, 2016" << std::endl << std::endl;
+	const bool interactive = argc < 2;
 
-    std::cout << "Enter ROM filepath: ";
+	try
+	{
+		if (interactive)
+		{
+			std::cout << std::endl << "QProc emulator" << std::endl <<
+				"Qwertygid, 2016" << std::endl << std::endl;
 
-    std::string filename;
-    std::cin >> filename;
+			std::cout << "Enter ROM filepath: ";
 
-    std::cout << std::endl;
+			std::string filename;
+			std::cin >> filename;
 
-    try
+			std::cout << std::endl;
+
+			Emulator emulator(filename);
+			emulator.run();
+		}
+		else
+		{
+			const Options options = parse_args(argc, argv);
+			const Failures failures = options.threads == 1 ? run_roms(options) : run_roms_parallel(options);
+			if (failures.exit_status() != EXIT_SUCCESS)
+				return failures.exit_status();
+		}
+	}
+    catch (const EmulatorLimitError &ex)
     {
-        Emulator emulator(filename);
-        emulator.run();
+		std::cerr << ex.what() << std::endl;
+        return EXIT_LIMIT;
     }
     catch (const std::runtime_error &ex)
     {
@@ -51,10 +327,13 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-	std::cout << std::endl << "The program has finished. Press ENTER to continue..." << std::endl;
+	if (interactive)
+	{
+		std::cout << std::endl << "The program has finished. Press ENTER to continue..." << std::endl;
 
-	std::cin.ignore();
-	std::cin.get();
+		std::cin.ignore();
+		std::cin.get();
+	}
 
     return EXIT_SUCCESS;
 }
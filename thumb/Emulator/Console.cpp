@@ -0,0 +1,16 @@
+#include "Console.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+uint32_t Console::read(const uint32_t /*offset*/, const unsigned int /*size*/)
+{
+	const int c = std::cin.get();
+	return c == std::char_traits<char>::eof() ? UINT32_MAX : static_cast<uint8_t>(c);
+}
+
+void Console::write(const uint32_t /*offset*/, const unsigned int /*size*/, const uint32_t value)
+{
+	std::cout.put(static_cast<char>(value & 0xFF));
+}
@@ -0,0 +1,18 @@
+#ifndef CONSOLE_HPP
+#define CONSOLE_HPP
+
+#include "Device.hpp"
+
+/*
+ * Standard input and output as a device: a store of any size writes its
+ * lowest byte out, a load of any size reads the next byte in, or 0xFFFFFFFF
+ * at the end of the input.
+ */
+class Console : public Device
+{
+public:
+	uint32_t read(const uint32_t offset, const unsigned int size) override;
+	void write(const uint32_t offset, const unsigned int size, const uint32_t value) override;
+};
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef DEVICE_HPP
+#define DEVICE_HPP
+
+#include <cstdint>
+
+// A memory-mapped device, it is handed the offset of an access into its page
+class Device
+{
+public:
+	virtual ~Device() {}
+
+	virtual uint32_t read(const uint32_t offset, const unsigned int size) = 0;
+	virtual void write(const uint32_t offset, const unsigned int size, const uint32_t value) = 0;
+};
+
+#endif
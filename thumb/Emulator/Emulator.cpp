@@ -1,269 +1,433 @@
 #include "Emulator.hpp"
 
 #include <bitset>
+#include <algorithm>
 #include <climits>
-#include <fstream>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
-#include <utility>
 
-Emulator::Emulator(std::string filename)
+Emulator::Emulator(std::string filename) :
+	image(filename, RAM_SIZE, sizeof(uint16_t)),
+	ram(image.data()),
+	io_pages((UINT64_C(1) << 32) / IO_PAGE_SIZE, nullptr)
 {
-	std::ifstream ifstr;
-	ifstr.open(filename, std::ios::binary | std::ios::ate);
-	if (!ifstr.is_open())
-		error("Failed to open the input file", false);
+	sp = RAM_SIZE;
 
-	std::streampos fsize = ifstr.tellg();
+	std::cout << "Filesize: " << image.file_size() << " bytes, loaded in " <<
+		image.load_time_ms() << " ms" << std::endl << std::endl;
+}
+
+void Emulator::map_device(const uint32_t address, Device &device)
+{
+	if (address < RAM_SIZE)
+		error("A device cannot be mapped over the RAM", false);
+
+	io_pages[address / IO_PAGE_SIZE] = &device;
+}
+
+template <typename T>
+T Emulator::load(const uint32_t address)
+{
+	// Inside the RAM and aligned at once, as RAM_SIZE is a power of 2
+	if ((address & (~(RAM_SIZE - 1) | (sizeof(T) - 1))) == 0)
+	{
+		T value;
+		std::memcpy(&value, ram + address, sizeof(T));
+		return value;
+	}
+
+	return static_cast<T>(load_io(address, sizeof(T)));
+}
+
+template <typename T>
+void Emulator::store(const uint32_t address, const T value)
+{
+	if ((address & (~(RAM_SIZE - 1) | (sizeof(T) - 1))) == 0)
+		std::memcpy(ram + address, &value, sizeof(T));
+	else
+		store_io(address, sizeof(T), value);
+}
+
+uint32_t Emulator::load_io(const uint32_t address, const unsigned int size)
+{
+	if (address & (size - 1))
+		error("Unaligned load from " + std::to_string(address), true);
+
+	Device *device = io_pages[address / IO_PAGE_SIZE];
+	if (device == nullptr)
+		error("Load from unmapped memory at " + std::to_string(address), true);
+
+	return device->read(address % IO_PAGE_SIZE, size);
+}
 
-	std::cout << "Filesize: " << fsize << " bytes" << std::endl << std::endl;
+void Emulator::store_io(const uint32_t address, const unsigned int size, const uint32_t value)
+{
+	if (address & (size - 1))
+		error("Unaligned store to " + std::to_string(address), true);
 
-	if (fsize > PM_SIZE * sizeof(uint16_t) || fsize % sizeof(uint16_t) != 0)
-		error("The input file is corrupt", false);
+	Device *device = io_pages[address / IO_PAGE_SIZE];
+	if (device == nullptr)
+		error("Store to unmapped memory at " + std::to_string(address), true);
 
-	ifstr.seekg(0);
+	device->write(address % IO_PAGE_SIZE, size, value);
+}
 
-	size_t PM_Cell = 0;
-	while (ifstr.tellg() < fsize)
-		ifstr.read(reinterpret_cast<char*>(&PM[PM_Cell++]), sizeof(uint16_t));
+constexpr Emulator::Handler Emulator::handler_of(const uint8_t top)
+{
+	// Longer signatures first, as they share prefixes with the shorter ones
+	return top == 0b11011111 ? &Emulator::software_interrupt :
+		top == 0b10110000 ? &Emulator::add_offset_to_sp :
+		top >> 2 == 0b010001 ? &Emulator::hi_register_operations :
+		top >> 2 == 0b010000 ? &Emulator::alu_operations :
+		top >> 3 == 0b00011 ? &Emulator::add_subtract :
+		top >> 3 == 0b01001 ? &Emulator::pc_relative_load :
+		top >> 3 == 0b11100 ? &Emulator::unconditional_branch :
+		top >> 4 == 0b0101 ? ((top >> 1 & 1) ? &Emulator::load_store_sign_extended : &Emulator::load_store_register_offset) :
+		top >> 4 == 0b1000 ? &Emulator::load_store_halfword :
+		top >> 4 == 0b1001 ? &Emulator::sp_relative_load_store :
+		top >> 4 == 0b1010 ? &Emulator::load_address :
+		top >> 4 == 0b1011 ? ((top >> 1 & 0b11) == 0b10 ? &Emulator::push_pop_registers : &Emulator::unknown_format) :
+		top >> 4 == 0b1100 ? &Emulator::multiple_load_store :
+		top >> 4 == 0b1101 ? &Emulator::conditional_branch :
+		top >> 4 == 0b1111 ? &Emulator::long_branch_with_link :
+		top >> 5 == 0b000 ? &Emulator::move_shifted_register :
+		top >> 5 == 0b001 ? &Emulator::move_compare_add_subtract_immediate :
+		top >> 5 == 0b011 ? &Emulator::load_store_immediate_offset :
+		&Emulator::unknown_format;
+}
 
-	ifstr.close();
+template <uint8_t... tops>
+constexpr Emulator::DecodeTable Emulator::make_decode_table(Tops<tops...>)
+{
+	return DecodeTable{ { handler_of(tops)... } };
 }
 
+const Emulator::DecodeTable Emulator::decode_table = Emulator::make_decode_table(AllTops<256>::type());
+
 void Emulator::run()
 {
-	for (; pc < PM_SIZE; pc++)
+	while (pc < RAM_SIZE)
 	{
-		switch (get_format_type(PM[pc]))
-		{
-		case 0:		// Software Interrupt
-			break;
-		case 1:		// Add offset to stack pointer
-			break;
-		case 2:		// Hi register operations/branch exchange
-			break;
-		case 3:		// ALU operations
-		{
-			uint16_t op = get_bit_sequence(PM[pc], 9, 6);
-			uint16_t rs = get_bit_sequence(PM[pc], 5, 3);
-			uint16_t rd = get_bit_sequence(PM[pc], 2, 0);
+		const uint16_t instr = load<uint16_t>(pc);
+		pc += 2;
+		(this->*decode_table.handlers[instr >> 8])(instr);
+	}
+}
 
-			if (rd >= R_SIZE)
-				error("RD is out of bounds", true);
-			else if (rs >= R_SIZE)
-				error("RS is out of bounds", true);
+// The register fields are 3 bits wide, so they always index R0 - R7
+void Emulator::move_shifted_register(const uint16_t instr)
+{
+	static constexpr ArgumentOp operations[4] =
+	{
+		&Emulator::LSL_imm5,
+		&Emulator::LSR_imm5,
+		&Emulator::ASR_imm5,
+		nullptr // Decoded as add/subtract
+	};
 
-			static const std::unordered_map<uint16_t, void(Emulator::*)(const uint16_t, const uint16_t)> operations =
-			{
-				{ 0b0000, &Emulator::AND_lo },
-				{ 0b0001, &Emulator::EOR_lo },
-				{ 0b0010, &Emulator::LSL_lo },
-				{ 0b0011, &Emulator::LSR_lo },
-				{ 0b0100, &Emulator::ASR_lo },
-			//	{ 0b0101, &Emulator::ADC_lo },
-			//	{ 0b0110, &Emulator::SBC_lo },
-				{ 0b0111, &Emulator::ROR_lo },
-				{ 0b1000, &Emulator::TST_lo },
-				{ 0b1001, &Emulator::NEG_lo },
-				{ 0b1010, &Emulator::CMP_lo },
-				{ 0b1011, &Emulator::CMN_lo },
-				{ 0b1100, &Emulator::ORR_lo },
-				{ 0b1101, &Emulator::MUL_lo },
-				{ 0b1110, &Emulator::BIC_lo },
-				{ 0b1111, &Emulator::MVN_lo },
-			};
-
-			auto it = operations.find(op);
-			if (it == operations.end())
-				error("Unknown instruction of the 'ALU operations' format type", true);
-			(this->*(it->second))(rs, rd);
-		}
-			break;
-		case 4:		// Add/subtract
-		{
-			uint8_t i = get_bit(PM[pc], 10);
-			uint8_t op = get_bit(PM[pc], 9);
-			uint16_t argument = get_bit_sequence(PM[pc], 8, 6);
-			uint16_t rs = get_bit_sequence(PM[pc], 5, 3);
-			uint16_t rd = get_bit_sequence(PM[pc], 2, 0);
-
-			if (rd >= R_SIZE)
-				error("RD is out of bounds", true);
-			else if (rs >= R_SIZE)
-				error("RS is out of bounds", true);
-			else if (!i && argument >= R_SIZE)
-				error("RN/Offset3 is out of bounds", true);
-
-			op <<= 1;
-			op += i;
-
-			static const std::unordered_map<uint16_t, void(Emulator::*)(const uint16_t, const uint16_t, const uint16_t)> operations =
-			{
-				{ 0b00, &Emulator::ADD_lo },
-				{ 0b01, &Emulator::ADD_imm3 },
-				{ 0b10, &Emulator::SUB_lo },
-				{ 0b11, &Emulator::SUB_imm3 }
-			};
-
-			auto it = operations.find(op);
-			if (it == operations.end())
-				error("Unknown instruction of the 'Add/subtract' format type", true);
-			(this->*(it->second))(argument, rs, rd);
-		}
-			break;
-		case 5:		// PC-relative load
-			break;
-		case 6:		// Unconditional branch
-			break;
-		case 7:		// Load/store with register offset
-			break;
-		case 8:		// Load/store sign-extended byte/halfword
-			break;
-		case 9:		// Load/store halfword
-			break;
-		case 10:	// SP-relative load/store
-			break;
-		case 11:	// Load address
-			break;
-		case 12:	// Push/pop registers
-			break;
-		case 13:	// Multiple load/store
-			break;
-		case 14:	// Conditional branch
-			break;
-		case 15:	// Long branch with link
-			break;
-		case 16:	// Move shifted register
-		{
-			uint16_t op = get_bit_sequence(PM[pc], 12, 11);
-			uint16_t offset5 = get_bit_sequence(PM[pc], 10, 6);
-			uint16_t rs = get_bit_sequence(PM[pc], 5, 3);
-			uint16_t rd = get_bit_sequence(PM[pc], 2, 0);
+	const ArgumentOp operation = operations[extract<12, 11>(instr)];
+	if (operation == nullptr)
+		error("Unknown instruction of the 'Move shifted register' format type", true);
+	(this->*operation)(extract<10, 6>(instr), extract<5, 3>(instr), extract<2, 0>(instr));
+}
+
+void Emulator::add_subtract(const uint16_t instr)
+{
+	// Indexed by the I and Op bits, RN and Offset3 share the argument field
+	static constexpr ArgumentOp operations[4] =
+	{
+		&Emulator::ADD_lo,
+		&Emulator::SUB_lo,
+		&Emulator::ADD_imm3,
+		&Emulator::SUB_imm3
+	};
 
-			if (rd >= R_SIZE)
-				error("RD is out of bounds", true);
-			else if (rs >= R_SIZE)
-				error("RS is out of bounds", true);
+	(this->*operations[extract<10, 9>(instr)])(extract<8, 6>(instr), extract<5, 3>(instr), extract<2, 0>(instr));
+}
 
-			static const std::unordered_map<uint16_t, void(Emulator::*)(const uint16_t, const uint16_t, const uint16_t)> operations =
-			{
-				{ 0b00, &Emulator::LSL_imm5 },
-				{ 0b01, &Emulator::LSR_imm5 },
-				{ 0b10, &Emulator::ASR_imm5 }
-			};
-
-			auto it = operations.find(op);
-			if (it == operations.end())
-				error("Unknown instruction of the 'Move shifted register' format type", true);
-			(this->*(it->second))(offset5, rs, rd);
-		}
-			break;
-		case 17:	// Move/compare/add/subtract immediate
-		{
-			uint16_t op = get_bit_sequence(PM[pc], 12, 11);
-			uint16_t rd = get_bit_sequence(PM[pc], 10, 8);
-			uint16_t offset8 = get_bit_sequence(PM[pc], 7, 0);
+void Emulator::move_compare_add_subtract_immediate(const uint16_t instr)
+{
+	static constexpr ImmediateOp operations[4] =
+	{
+		&Emulator::MOV_imm8,
+		&Emulator::CMP_imm8,
+		&Emulator::ADD_imm8,
+		&Emulator::SUB_imm8
+	};
 
-			if (rd >= R_SIZE)
-				error("RD is out of bounds", true);
+	(this->*operations[extract<12, 11>(instr)])(extract<10, 8>(instr), extract<7, 0>(instr));
+}
 
-			static const std::unordered_map<uint16_t, void(Emulator::*)(const uint16_t, const uint16_t)> operations =
-			{
-				{ 0b00, &Emulator::MOV_imm8 },
-				{ 0b01, &Emulator::CMP_imm8 },
-				{ 0b10, &Emulator::ADD_imm8 },
-				{ 0b11, &Emulator::SUB_imm8 }
-			};
-
-			auto it = operations.find(op);
-			if (it == operations.end())
-				error("Unknown instruction of the 'Move/compare/add/subtract immediate' format type", true);
-			(this->*(it->second))(rd, offset8);
-		}
-			break;
-		case 18:	// Load/store with immediate offset
-			break;
-		default:
-			error("Unknown format type", true);
-		}
+void Emulator::alu_operations(const uint16_t instr)
+{
+	static constexpr AluOp operations[16] =
+	{
+		&Emulator::AND_lo,
+		&Emulator::EOR_lo,
+		&Emulator::LSL_lo,
+		&Emulator::LSR_lo,
+		&Emulator::ASR_lo,
+		&Emulator::ADC_lo,
+		&Emulator::SBC_lo,
+		&Emulator::ROR_lo,
+		&Emulator::TST_lo,
+		&Emulator::NEG_lo,
+		&Emulator::CMP_lo,
+		&Emulator::CMN_lo,
+		&Emulator::ORR_lo,
+		&Emulator::MUL_lo,
+		&Emulator::BIC_lo,
+		&Emulator::MVN_lo
+	};
+
+	const AluOp operation = operations[extract<9, 6>(instr)];
+	if (operation == nullptr)
+		error("Unknown instruction of the 'ALU operations' format type", true);
+	(this->*operation)(extract<5, 3>(instr), extract<2, 0>(instr));
+}
+
+// Only R0 - R7 exist
+void Emulator::hi_register_operations(const uint16_t)
+{
+	error("Hi register operations are not in the shortened instruction set", true);
+}
+
+void Emulator::pc_relative_load(const uint16_t instr)
+{
+	r[extract<10, 8>(instr)] = load<uint32_t>(((pc + 2) & ~3u) + (extract<7, 0>(instr) << 2));
+}
+
+void Emulator::load_store_register_offset(const uint16_t instr)
+{
+	const uint32_t address = r[extract<8, 6>(instr)] + r[extract<5, 3>(instr)];
+	const uint16_t rd = extract<2, 0>(instr);
+
+	switch (extract<11, 10>(instr)) // L and B bits
+	{
+	case 0b00:
+		store<uint32_t>(address, r[rd]);
+		break;
+
+	case 0b01:
+		store<uint8_t>(address, r[rd]);
+		break;
+
+	case 0b10:
+		r[rd] = load<uint32_t>(address);
+		break;
+
+	case 0b11:
+		r[rd] = load<uint8_t>(address);
+		break;
 	}
 }
 
-uint16_t Emulator::get_bit_sequence(const uint16_t number, const size_t msb, const size_t lsb) const
+void Emulator::load_store_sign_extended(const uint16_t instr)
 {
-	if (msb >= sizeof(uint16_t) * CHAR_BIT)
-		error("MSB argument is out of range in get_bit_sequence()", true);
-	if (lsb >= sizeof(uint16_t) * CHAR_BIT)
-		error("LSB argument is out of range in get_bit_sequence()", true);
-	if (msb < lsb)
-		error("MSB is less than LSB in get_bit_sequence()", true);
+	const uint32_t address = r[extract<8, 6>(instr)] + r[extract<5, 3>(instr)];
+	const uint16_t rd = extract<2, 0>(instr);
 
-	uint16_t n = 1;
-	for (size_t i = 0; i < msb - lsb; i++)
+	switch (extract<11, 10>(instr)) // H and S bits
 	{
-		n <<= 1;
-		n++;
+	case 0b00:
+		store<uint16_t>(address, r[rd]);
+		break;
+
+	case 0b01:
+		r[rd] = static_cast<int8_t>(load<uint8_t>(address));
+		break;
+
+	case 0b10:
+		r[rd] = load<uint16_t>(address);
+		break;
+
+	case 0b11:
+		r[rd] = static_cast<int16_t>(load<uint16_t>(address));
+		break;
 	}
+}
+
+void Emulator::load_store_immediate_offset(const uint16_t instr)
+{
+	const uint32_t base = r[extract<5, 3>(instr)];
+	const uint16_t offset5 = extract<10, 6>(instr);
+	const uint16_t rd = extract<2, 0>(instr);
 
-	return (number >> lsb) & n;
+	switch (extract<12, 11>(instr)) // B and L bits
+	{
+	case 0b00:
+		store<uint32_t>(base + (offset5 << 2), r[rd]);
+		break;
+
+	case 0b01:
+		r[rd] = load<uint32_t>(base + (offset5 << 2));
+		break;
+
+	case 0b10:
+		store<uint8_t>(base + offset5, r[rd]);
+		break;
+
+	case 0b11:
+		r[rd] = load<uint8_t>(base + offset5);
+		break;
+	}
 }
 
-uint8_t Emulator::get_bit(const uint32_t number, const int bit) const
+void Emulator::load_store_halfword(const uint16_t instr)
 {
-	if (bit >= sizeof(uint32_t) * CHAR_BIT || bit < 0)
-		error("Bit argument is out of range in get_bit()", true);
+	const uint32_t address = r[extract<5, 3>(instr)] + (extract<10, 6>(instr) << 1);
+	const uint16_t rd = extract<2, 0>(instr);
 
-	return (number >> bit) & 1;
+	if (extract<11, 11>(instr))
+		r[rd] = load<uint16_t>(address);
+	else
+		store<uint16_t>(address, r[rd]);
 }
 
-int Emulator::get_format_type(const uint16_t instr) const
+void Emulator::sp_relative_load_store(const uint16_t instr)
 {
-	const size_t SIGNATURES_NUM = 19;
-	const std::pair<uint16_t, int> signatures[] = // { signature, its length }
-	{
-		{ 0b11011111,	8 },	// #0; Software Interrupt
-		{ 0b10110000,	8 },	// #1; Add offset to stack pointer
-		{ 0b010001,		6 },	// #2; Hi register operations/branch exchange
-		{ 0b010000,		6 },	// #3; ALU operations
-		{ 0b00011,		5 },	// #4; Add/subtract
-		{ 0b01001,		5 },	// #5; PC-relative load
-		{ 0b11100,		5 },	// #6; Unconditional branch
-		{ 0b0101,		4 },	// #7; Load/store with register offset (check if bit 9 is 0)
-		{ 0b0101,		4 },	// #8; Load/store sign-extended byte/halfword (check if bit 9 is 1)
-		{ 0b1000,		4 },	// #9; Load/store halfword
-		{ 0b1001,		4 },	// #10; SP-relative load/store
-		{ 0b1010,		4 },	// #11; Load address
-		{ 0b1011,		4 },	// #12; Push/pop registers (check if bits 10 & 9 are 10)
-		{ 0b1100,		4 },	// #13; Multiple load/store
-		{ 0b1101,		4 },	// #14; Conditional branch
-		{ 0b1111,		4 },	// #15; Long branch with link
-		{ 0b000,		3 },	// #16; Move shifted register
-		{ 0b001,		3 },	// #17; Move/compare/add/subtract immediate
-		{ 0b011,		3 }		// #18; Load/store with immediate offset
-	};
+	const uint32_t address = sp + (extract<7, 0>(instr) << 2);
+	const uint16_t rd = extract<10, 8>(instr);
+
+	if (extract<11, 11>(instr))
+		r[rd] = load<uint32_t>(address);
+	else
+		store<uint32_t>(address, r[rd]);
+}
+
+void Emulator::load_address(const uint16_t instr)
+{
+	const uint32_t base = extract<11, 11>(instr) ? sp : (pc + 2) & ~3u;
+	r[extract<10, 8>(instr)] = base + (extract<7, 0>(instr) << 2);
+}
 
-	for (size_t i = 0; i < SIGNATURES_NUM; i++)
+void Emulator::add_offset_to_sp(const uint16_t instr)
+{
+	const uint32_t offset = extract<6, 0>(instr) << 2;
+	if (extract<7, 7>(instr))
+		sp -= offset;
+	else
+		sp += offset;
+}
+
+// PUSH stores the lowest register at the lowest address, POP loads it first
+void Emulator::push_pop_registers(const uint16_t instr)
+{
+	const uint16_t rlist = extract<7, 0>(instr);
+	const bool link = extract<8, 8>(instr);
+
+	if (extract<11, 11>(instr))
 	{
-		if ((instr >> (15 - signatures[i].second + 1)) == signatures[i].first)
+		uint32_t address = sp;
+		for (size_t i = 0; i < R_SIZE; i++)
+			if (rlist >> i & 1)
+			{
+				r[i] = load<uint32_t>(address);
+				address += 4;
+			}
+		if (link)
 		{
-			switch (signatures[i].first)
+			pc = load<uint32_t>(address) & ~1u;
+			address += 4;
+		}
+		sp = address;
+	}
+	else
+	{
+		uint32_t address = sp - 4 * (std::bitset<R_SIZE>(rlist).count() + link);
+		sp = address;
+		for (size_t i = 0; i < R_SIZE; i++)
+			if (rlist >> i & 1)
 			{
-			case 0b0101:
-				if (get_bit(instr, 9) == 1)
-					return i + 1;
-				break;
-			case 0b1011:
-				if (get_bit_sequence(instr, 10, 9) != 0b10)
-					continue;
-            default:
-                return i;
+				store<uint32_t>(address, r[i]);
+				address += 4;
 			}
+		if (link)
+			store<uint32_t>(address, lr);
+	}
+}
+
+void Emulator::multiple_load_store(const uint16_t instr)
+{
+	const uint16_t rb = extract<10, 8>(instr);
+	const uint16_t rlist = extract<7, 0>(instr);
+	const bool load_multiple = extract<11, 11>(instr);
+
+	if (rlist == 0)
+		error("Empty register list in LDMIA/STMIA", true);
+
+	uint32_t address = r[rb];
+	for (size_t i = 0; i < R_SIZE; i++)
+		if (rlist >> i & 1)
+		{
+			if (load_multiple)
+				r[i] = load<uint32_t>(address);
+			else
+				store<uint32_t>(address, r[i]);
+			address += 4;
 		}
+
+	// A loaded base keeps the loaded value
+	if (!load_multiple || !(rlist >> rb & 1))
+		r[rb] = address;
+}
+
+bool Emulator::condition_passed(const uint16_t cond) const
+{
+	switch (cond)
+	{
+	case 0b0000: return get_flag(Flags::Z); // EQ
+	case 0b0001: return !get_flag(Flags::Z); // NE
+	case 0b0010: return get_flag(Flags::C); // CS
+	case 0b0011: return !get_flag(Flags::C); // CC
+	case 0b0100: return get_flag(Flags::N); // MI
+	case 0b0101: return !get_flag(Flags::N); // PL
+	case 0b0110: return get_flag(Flags::V); // VS
+	case 0b0111: return !get_flag(Flags::V); // VC
+	case 0b1000: return get_flag(Flags::C) && !get_flag(Flags::Z); // HI
+	case 0b1001: return !get_flag(Flags::C) || get_flag(Flags::Z); // LS
+	case 0b1010: return get_flag(Flags::N) == get_flag(Flags::V); // GE
+	case 0b1011: return get_flag(Flags::N) != get_flag(Flags::V); // LT
+	case 0b1100: return !get_flag(Flags::Z) && get_flag(Flags::N) == get_flag(Flags::V); // GT
+	case 0b1101: return get_flag(Flags::Z) || get_flag(Flags::N) != get_flag(Flags::V); // LE
+	}
+
+	error("Undefined condition in a conditional branch", true);
+	return false;
+}
+
+void Emulator::conditional_branch(const uint16_t instr)
+{
+	if (condition_passed(extract<11, 8>(instr)))
+		pc += 2 + sign_extend<9>(extract<7, 0>(instr) << 1);
+}
+
+// Not specified for the shortened instruction set
+void Emulator::software_interrupt(const uint16_t) {}
+
+void Emulator::unconditional_branch(const uint16_t instr)
+{
+	pc += 2 + sign_extend<12>(extract<10, 0>(instr) << 1);
+}
+
+// The high half of the offset goes to LR first, the low half makes the jump
+void Emulator::long_branch_with_link(const uint16_t instr)
+{
+	if (extract<11, 11>(instr))
+	{
+		const uint32_t target = lr + (extract<10, 0>(instr) << 1);
+		lr = pc; // No interworking bit, ADD R7, R6, #0 returns
+		pc = target;
 	}
+	else
+		lr = pc + 2 + sign_extend<23>(extract<10, 0>(instr) << 12);
+}
 
-	return -1;
+void Emulator::unknown_format(const uint16_t)
+{
+	error("Unknown format type", true);
 }
 
 uint32_t Emulator::ror(const uint32_t number, const unsigned int len) const
@@ -285,248 +449,252 @@ void Emulator::error(const std::string msg, bool register_dump) const
 			exception_text += "\nR" + std::to_string(i) + ": " + std::to_string(r[i]);
 
 		exception_text += "\nSP: " + std::to_string(sp) + "\nLR: " + std::to_string(lr) +
-			"\nPC: " + std::to_string(pc) + "\nCPSR: " + std::bitset<32>(cpsr).to_string();
+			"\nPC: " + std::to_string(pc) + "\nCPSR: " + std::bitset<32>(get_cpsr()).to_string();
 	}
 
 	throw std::runtime_error(exception_text);
 }
 
-void Emulator::LSL_imm5(const uint16_t offset5, const uint16_t rs, const uint16_t rd)
+bool Emulator::get_flag(const Flags flag) const
+{
+	switch (flag)
+	{
+	case Flags::N:
+		return flag_result >> 31;
+
+	case Flags::Z:
+		return flag_result == 0;
+
+	case Flags::C:
+		if (carry_shifted)
+			return shift_carry;
+		if (flag_arith == Arith::ADD)
+			return (static_cast<uint64_t>(flag_lhs) + flag_rhs + flag_carry_in) >> 32;
+		if (flag_arith == Arith::SUB)
+			return flag_lhs >= static_cast<uint64_t>(flag_rhs) + 1 - flag_carry_in;
+		return false;
+
+	case Flags::V:
+		if (flag_arith == Arith::ADD)
+		{
+			const uint32_t result = flag_lhs + flag_rhs + flag_carry_in;
+			return ((flag_lhs ^ result) & (flag_rhs ^ result)) >> 31;
+		}
+		if (flag_arith == Arith::SUB)
+		{
+			const uint32_t result = flag_lhs - flag_rhs - (1 - flag_carry_in);
+			return ((flag_lhs ^ flag_rhs) & (flag_lhs ^ result)) >> 31;
+		}
+		return false;
+	}
+
+	return false;
+}
+
+uint32_t Emulator::get_cpsr() const
+{
+	return get_flag(Flags::N) << Flags::N | get_flag(Flags::Z) << Flags::Z |
+		get_flag(Flags::C) << Flags::C | get_flag(Flags::V) << Flags::V;
+}
+
+uint32_t Emulator::add_with_flags(const uint32_t lhs, const uint32_t rhs, const uint32_t carry_in)
 {
-	r[rd] = r[rs] << offset5;
+	flag_arith = Arith::ADD;
+	flag_lhs = lhs;
+	flag_rhs = rhs;
+	flag_carry_in = carry_in;
+	carry_shifted = false;
 
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	return flag_result = lhs + rhs + carry_in;
+}
+
+uint32_t Emulator::subtract_with_flags(const uint32_t lhs, const uint32_t rhs, const uint32_t carry_in)
+{
+	flag_arith = Arith::SUB;
+	flag_lhs = lhs;
+	flag_rhs = rhs;
+	flag_carry_in = carry_in;
+	carry_shifted = false;
+
+	return flag_result = lhs - rhs - (1 - carry_in);
+}
+
+void Emulator::set_shift_carry(const uint32_t carry)
+{
+	carry_shifted = true;
+	shift_carry = carry;
+}
+
+// An immediate shift by 0 is LSL #0 (C is kept), LSR #32 or ASR #32
+void Emulator::LSL_imm5(const uint16_t offset5, const uint16_t rs, const uint16_t rd)
+{
 	if (offset5 > 0)
-		cpsr[Flags::C] = get_bit(r[rs], 31 - offset5 + 1);
+		set_shift_carry((r[rs] >> (32 - offset5)) & 1);
 
+	flag_result = r[rd] = r[rs] << offset5;
 }
 
 void Emulator::LSR_imm5(const uint16_t offset5, const uint16_t rs, const uint16_t rd)
 {
-	r[rd] = r[rs] >> offset5;
+	const unsigned int len = offset5 > 0 ? offset5 : 32;
+	set_shift_carry((r[rs] >> (len - 1)) & 1);
 
-    cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
-	if (offset5 > 0)
-		cpsr[Flags::C] = get_bit(r[rs], 31 - offset5 + 1);
+	flag_result = r[rd] = static_cast<uint64_t>(r[rs]) >> len;
 }
 
 void Emulator::ASR_imm5(const uint16_t offset5, const uint16_t rs, const uint16_t rd)
 {
-	r[rd] = static_cast<int32_t>(r[rs]) >> offset5;
+	const unsigned int len = offset5 > 0 ? offset5 : 32;
+	set_shift_carry((r[rs] >> (len - 1)) & 1);
 
-    cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
-	if (offset5 > 0)
-		cpsr[Flags::C] = get_bit(r[rs], 31 - offset5 + 1);
+	flag_result = r[rd] = static_cast<int64_t>(static_cast<int32_t>(r[rs])) >> len;
 }
 
 void Emulator::ADD_lo(const uint16_t rn, const uint16_t rs, const uint16_t rd)
 {
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
-	cpsr[Flags::C] = r[rs] > UINT32_MAX - r[rn];
-	cpsr[Flags::V] = r[rs] > INT32_MAX - r[rn];
-
-	r[rd] = r[rs] + r[rn];
+	r[rd] = add_with_flags(r[rs], r[rn], 0);
 }
 
 void Emulator::ADD_imm3(const uint16_t offset3, const uint16_t rs, const uint16_t rd)
 {
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
-	cpsr[Flags::C] = r[rs] > UINT32_MAX - offset3;
-	cpsr[Flags::V] = r[rs] > INT32_MAX - offset3;
-
-	r[rd] = r[rs] + offset3;
+	r[rd] = add_with_flags(r[rs], offset3, 0);
 }
 
 void Emulator::SUB_lo(const uint16_t rn, const uint16_t rs, const uint16_t rd)
 {
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
-	cpsr[Flags::C] = r[rs] < r[rn];
-	cpsr[Flags::V] = r[rs] < INT32_MIN + r[rn];
-
-	r[rd] = r[rs] - r[rn];
+	r[rd] = subtract_with_flags(r[rs], r[rn], 1);
 }
 
 void Emulator::SUB_imm3(const uint16_t offset3, const uint16_t rs, const uint16_t rd)
 {
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
-	cpsr[Flags::C] = r[rs] < offset3;
-	cpsr[Flags::V] = r[rs] < INT32_MIN + offset3;
-
-	r[rd] = r[rs] - offset3;
+	r[rd] = subtract_with_flags(r[rs], offset3, 1);
 }
 
 void Emulator::MOV_imm8(const uint16_t rd, const uint16_t offset8)
 {
-	r[rd] = offset8;
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd] = offset8;
 }
 
 void Emulator::CMP_imm8(const uint16_t rd, const uint16_t offset8)
 {
-	cpsr[Flags::C] = r[rd] < offset8;
-	cpsr[Flags::V] = r[rd] < INT32_MIN + offset8;
-
-	uint32_t tmp_result = r[rd] - offset8;
-
-	cpsr[Flags::N] = get_bit(tmp_result, NEGATIVE_BIT);
-	cpsr[Flags::Z] = tmp_result == 0;
+	subtract_with_flags(r[rd], offset8, 1);
 }
 
 void Emulator::ADD_imm8(const uint16_t rd, const uint16_t offset8)
 {
-	cpsr[Flags::C] = r[rd] > UINT32_MAX - offset8;
-	cpsr[Flags::V] = r[rd] > INT32_MAX - offset8;
-
-	r[rd] += offset8;
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	r[rd] = add_with_flags(r[rd], offset8, 0);
 }
 
 void Emulator::SUB_imm8(const uint16_t rd, const uint16_t offset8)
 {
-	cpsr[Flags::C] = r[rd] < offset8;
-	cpsr[Flags::V] = r[rd] < INT32_MIN + offset8;
-
-	r[rd] -= offset8;
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	r[rd] = subtract_with_flags(r[rd], offset8, 1);
 }
 
 void Emulator::AND_lo(const uint16_t rs, const uint16_t rd)
 {
-	r[rd] &= r[rs];
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd] &= r[rs];
 }
 
 void Emulator::EOR_lo(const uint16_t rs, const uint16_t rd)
 {
-	r[rd] ^= r[rs];
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd] ^= r[rs];
 }
 
+// Shifts by a register use its bottom byte, 0 keeps both the value and C
 void Emulator::LSL_lo(const uint16_t rs, const uint16_t rd)
 {
-	if (r[rs] > 0)
-		cpsr[Flags::C] = get_bit(r[rd], 31 - r[rs] + 1);
-
-	r[rd] <<= r[rs];
+	const unsigned int len = r[rs] & 0xFF;
+	if (len > 0)
+	{
+		set_shift_carry(len <= 32 ? (static_cast<uint64_t>(r[rd]) << len) >> 32 & 1 : 0);
+		r[rd] = len < 32 ? r[rd] << len : 0;
+	}
 
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd];
 }
 
 void Emulator::LSR_lo(const uint16_t rs, const uint16_t rd)
 {
-	if (r[rs] > 0)
-		cpsr[Flags::C] = get_bit(r[rd], r[rs] - 1);
-
-	r[rd] >>= r[rs];
+	const unsigned int len = r[rs] & 0xFF;
+	if (len > 0)
+	{
+		set_shift_carry(len <= 32 ? (r[rd] >> (len - 1)) & 1 : 0);
+		r[rd] = len < 32 ? r[rd] >> len : 0;
+	}
 
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd];
 }
 
 void Emulator::ASR_lo(const uint16_t rs, const uint16_t rd)
 {
-	if (r[rs] > 0)
-		cpsr[Flags::C] = get_bit(r[rd], r[rs] - 1);
-
-	r[rd] = static_cast<int32_t>(r[rd]) >> r[rs];
+	const unsigned int len = std::min(r[rs] & 0xFF, 32u);
+	if (len > 0)
+	{
+		set_shift_carry((r[rd] >> (len - 1)) & 1);
+		r[rd] = static_cast<int64_t>(static_cast<int32_t>(r[rd])) >> len;
+	}
 
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd];
 }
 
 void Emulator::ROR_lo(const uint16_t rs, const uint16_t rd)
 {
-	if (r[rs] > 0)
-		cpsr[Flags::C] = get_bit(r[rd], r[rs] - 1);
-
-	r[rd] = ror(r[rd], r[rs]);
+	const unsigned int len = r[rs] & 0xFF;
+	if (len > 0)
+	{
+		r[rd] = ror(r[rd], len & 31);
+		set_shift_carry(r[rd] >> 31);
+	}
 
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd];
 }
 
 void Emulator::TST_lo(const uint16_t rs, const uint16_t rd)
 {
-	uint32_t tmp_result = r[rd] & r[rs];
+	flag_result = r[rd] & r[rs];
+}
 
-	cpsr[Flags::N] = get_bit(tmp_result, NEGATIVE_BIT);
-	cpsr[Flags::Z] = tmp_result == 0;
+void Emulator::ADC_lo(const uint16_t rs, const uint16_t rd)
+{
+	r[rd] = add_with_flags(r[rd], r[rs], get_flag(Flags::C));
 }
 
-void Emulator::NEG_lo(const uint16_t rs, const uint16_t rd) // fix
+void Emulator::SBC_lo(const uint16_t rs, const uint16_t rd)
 {
-	r[rd] = -r[rs];
+	r[rd] = subtract_with_flags(r[rd], r[rs], get_flag(Flags::C));
+}
 
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+void Emulator::NEG_lo(const uint16_t rs, const uint16_t rd)
+{
+	r[rd] = subtract_with_flags(0, r[rs], 1);
 }
 
 void Emulator::CMP_lo(const uint16_t rs, const uint16_t rd)
 {
-	uint32_t tmp_result = r[rd] - r[rs];
-
-	cpsr[Flags::N] = get_bit(tmp_result, NEGATIVE_BIT);
-	cpsr[Flags::Z] = tmp_result == 0;
-	cpsr[Flags::C] = r[rd] < r[rs];
-	cpsr[Flags::V] = r[rd] < INT32_MIN + r[rs];
+	subtract_with_flags(r[rd], r[rs], 1);
 }
 
 void Emulator::CMN_lo(const uint16_t rs, const uint16_t rd)
 {
-	uint32_t tmp_result = r[rd] - (~r[rs]);
-
-	cpsr[Flags::N] = get_bit(tmp_result, NEGATIVE_BIT);
-	cpsr[Flags::Z] = tmp_result == 0;
-	cpsr[Flags::C] = r[rd] < r[rs];
-	cpsr[Flags::V] = r[rd] < INT32_MIN + r[rs];
+	add_with_flags(r[rd], r[rs], 0);
 }
 
 void Emulator::ORR_lo(const uint16_t rs, const uint16_t rd)
 {
-	r[rd] |= r[rs];
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd] |= r[rs];
 }
 
 void Emulator::MUL_lo(const uint16_t rs, const uint16_t rd)
 {
-	r[rd] *= r[rs];
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd] *= r[rs];
 }
 
 void Emulator::BIC_lo(const uint16_t rs, const uint16_t rd)
 {
-	r[rd] &= ~r[rs];
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd] &= ~r[rs];
 }
 
 void Emulator::MVN_lo(const uint16_t rs, const uint16_t rd)
 {
-	r[rd] = ~r[rs];
-
-	cpsr[Flags::N] = get_bit(r[rd], NEGATIVE_BIT);
-	cpsr[Flags::Z] = r[rd] == 0;
+	flag_result = r[rd] = ~r[rs];
 }
@@ -4,40 +4,140 @@
 #include <cstdint>
 #include <cstdlib>
 #include <string>
+#include <vector>
 
+#include "../../image/Image.hpp"
+#include "Device.hpp"
+
+/*
+ * Memory is byte-addressed: the program is loaded at 0 into RAM_SIZE bytes
+ * of flat RAM, and the rest of the address space is split into pages that
+ * devices can be mapped into. Execution stops once the PC leaves the RAM.
+ * SP starts at the top of the RAM, the stack is full descending.
+ */
 class Emulator
 {
 public:
 	Emulator(const std::string filename);
 
+	void map_device(const uint32_t address, Device &device); // Maps the page the address is in
+
 	void run();
 
+	static const uint32_t IO_PAGE_SIZE = 0x10000;
+
 private:
-	uint16_t get_bit_sequence(const uint16_t number, const size_t msb, const size_t lsb) const;
-	uint8_t get_bit(const uint32_t number, const int bit) const;
-	int get_format_type(const uint16_t instr) const;
+	typedef void (Emulator::*Handler)(const uint16_t instr);
+
+	// Every format is told apart by the top 8 bits of the instruction
+	struct DecodeTable
+	{
+		Handler handlers[256];
+	};
+
+	static constexpr Handler handler_of(const uint8_t top);
+	// 0 - 255 as a parameter pack, a C++11 constexpr function cannot loop over them
+	template <uint8_t... tops> struct Tops {};
+	template <unsigned n, uint8_t... tops> struct AllTops : AllTops<n - 1, n - 1, tops...> {};
+	template <uint8_t... tops> struct AllTops<0, tops...> { typedef Tops<tops...> type; };
+
+	template <uint8_t... tops>
+	static constexpr DecodeTable make_decode_table(Tops<tops...>);
+	static const DecodeTable decode_table; // Constant-initialized from make_decode_table()
+
+	// One per instruction format, they extract their own operands
+	void move_shifted_register(const uint16_t instr);
+	void add_subtract(const uint16_t instr);
+	void move_compare_add_subtract_immediate(const uint16_t instr);
+	void alu_operations(const uint16_t instr);
+	void hi_register_operations(const uint16_t instr);
+	void pc_relative_load(const uint16_t instr);
+	void load_store_register_offset(const uint16_t instr);
+	void load_store_sign_extended(const uint16_t instr);
+	void load_store_immediate_offset(const uint16_t instr);
+	void load_store_halfword(const uint16_t instr);
+	void sp_relative_load_store(const uint16_t instr);
+	void load_address(const uint16_t instr);
+	void add_offset_to_sp(const uint16_t instr);
+	void push_pop_registers(const uint16_t instr);
+	void multiple_load_store(const uint16_t instr);
+	void conditional_branch(const uint16_t instr);
+	void software_interrupt(const uint16_t instr);
+	void unconditional_branch(const uint16_t instr);
+	void long_branch_with_link(const uint16_t instr);
+	void unknown_format(const uint16_t instr);
+
+	typedef void (Emulator::*ArgumentOp)(const uint16_t argument, const uint16_t rs, const uint16_t rd);
+	typedef void (Emulator::*ImmediateOp)(const uint16_t rd, const uint16_t offset8);
+	typedef void (Emulator::*AluOp)(const uint16_t rs, const uint16_t rd);
+
+	// Bits msb..lsb of an instruction, the range is checked at compile time
+	template <unsigned msb, unsigned lsb>
+	static constexpr uint16_t extract(const uint16_t instr)
+	{
+		static_assert(msb < 16 && lsb <= msb, "Bit range is out of an instruction");
+		return (instr >> lsb) & ((1u << (msb - lsb + 1)) - 1);
+	}
+
+	template <unsigned bits>
+	static constexpr int32_t sign_extend(const uint32_t value)
+	{
+		return static_cast<int32_t>(value << (32 - bits)) >> (32 - bits);
+	}
+
+	bool condition_passed(const uint16_t cond) const;
+
+	// Accesses must be aligned to their size
+	template <typename T> T load(const uint32_t address);
+	template <typename T> void store(const uint32_t address, const T value);
+	uint32_t load_io(const uint32_t address, const unsigned int size);
+	void store_io(const uint32_t address, const unsigned int size, const uint32_t value);
 
 	uint32_t ror(const uint32_t number, const unsigned int len) const;
 
 	void error(const std::string msg, bool register_dump) const;
 
-	const int NEGATIVE_BIT = 31;
+	static const uint32_t RAM_SIZE = 0x80000; // A power of 2, see load()
+	Image image;
+	uint8_t *ram;
 
-	static const size_t PM_SIZE = 204800;
-	uint16_t PM[PM_SIZE] = { 0 };
+	std::vector<Device*> io_pages; // nullptr - nothing is mapped there
 
 	static const size_t R_SIZE = 8; //R0 - R7
 	uint32_t r[R_SIZE] = { 0 };
 
+	// While an instruction executes PC already holds the address of the next
+	// one, ARM's PC (the instruction's address + 4) is pc + 2
 	uint32_t &sp = r[5], &lr = r[6], &pc = r[7];
 
-    enum Flags
+	enum Flags
 	{
 		N = 31, Z = 30, C = 29, V = 28
 	};
 
-	static const size_t CPSR_SIZE = 4;
-	uint8_t cpsr[CPSR_SIZE];
+	/*
+	 * The flags are not stored, they are worked out when read from what the
+	 * last operations that set them recorded: N and Z from the last result,
+	 * C and V from the operands of the last addition or subtraction, unless
+	 * a shift has set C since.
+	 */
+	enum class Arith : uint8_t
+	{
+		NONE, ADD, SUB
+	};
+
+	uint32_t flag_result = 0;
+	Arith flag_arith = Arith::NONE;
+	uint32_t flag_lhs = 0, flag_rhs = 0, flag_carry_in = 0;
+	bool carry_shifted = false;
+	uint32_t shift_carry = 0;
+
+	bool get_flag(const Flags flag) const;
+	uint32_t get_cpsr() const; // Flags at their CPSR bits
+
+	uint32_t add_with_flags(const uint32_t lhs, const uint32_t rhs, const uint32_t carry_in);
+	uint32_t subtract_with_flags(const uint32_t lhs, const uint32_t rhs, const uint32_t carry_in); // lhs - rhs - NOT carry_in
+	void set_shift_carry(const uint32_t carry);
 
 	void LSL_imm5(const uint16_t offset5, const uint16_t rs, const uint16_t rd);
 	void LSR_imm5(const uint16_t offset5, const uint16_t rs, const uint16_t rd);
@@ -60,6 +160,8 @@ private:
 	void ASR_lo(const uint16_t rs, const uint16_t rd);
 	void ROR_lo(const uint16_t rs, const uint16_t rd);
 	void TST_lo(const uint16_t rs, const uint16_t rd);
+	void ADC_lo(const uint16_t rs, const uint16_t rd);
+	void SBC_lo(const uint16_t rs, const uint16_t rd);
 	void NEG_lo(const uint16_t rs, const uint16_t rd);
 	void CMP_lo(const uint16_t rs, const uint16_t rd);
 	void CMN_lo(const uint16_t rs, const uint16_t rd);
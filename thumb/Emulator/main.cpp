@@ -1,3 +1,4 @@
+#include "Console.hpp"
 #include "Emulator.hpp"
 
 #include <iostream>
@@ -7,7 +8,9 @@ int main()
 {
 	try
 	{
+		Console console;
 		Emulator emulator("input.bin");
+		emulator.map_device(0x40000000, console); // A byte store there prints it
 		emulator.run();
 	}
 	catch (const std::runtime_error &ex)